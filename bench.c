@@ -0,0 +1,430 @@
+/*-
+ * The MIT License
+ *
+ * Copyright 2019 Darek Stojaczyk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Replays keystroke traces into cli_gets() running on the other side of
+ * a pseudo-terminal and measures how fast and how chatty the editor is.
+ *
+ * Each key is written to the pty master, then we wait until the editor
+ * responds with some output. The time that takes is the per-key latency.
+ * Syscalls are counted from /proc/<pid>/io of the editor process.
+ */
+
+#include <inttypes.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "cli_gets.h"
+
+#define BENCH_PROMPT "bench"
+#define BENCH_LINE_MAX (128 * 1024)
+#define BENCH_HISTORY 1000
+
+struct trace {
+	const char *name;
+	char *buf; /* all keys, back to back */
+	size_t len;
+	size_t *ends; /* end offset of each key in buf */
+	size_t nkeys;
+	size_t size;
+};
+
+static void
+trace_key(struct trace *t, const char *data, size_t len)
+{
+	if (t->len + len > t->size || t->nkeys == t->size) {
+		t->size = (t->size + len) * 2;
+		t->buf = realloc(t->buf, t->size);
+		t->ends = realloc(t->ends, t->size * sizeof(*t->ends));
+		if (t->buf == NULL || t->ends == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	memcpy(t->buf + t->len, data, len);
+	t->len += len;
+	t->ends[t->nkeys++] = t->len;
+}
+
+static void
+trace_str(struct trace *t, const char *str)
+{
+	trace_key(t, str, strlen(str));
+}
+
+/* type a line of n characters, one key at a time */
+static void
+trace_type(struct trace *t, size_t n)
+{
+	size_t i;
+	char c;
+
+	for (i = 0; i < n; i++) {
+		c = 'a' + i % 26;
+		trace_key(t, &c, 1);
+	}
+}
+
+static void
+gen_typing(struct trace *t)
+{
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		trace_type(t, 80);
+		trace_str(t, "\r");
+	}
+}
+
+static void
+gen_paste(struct trace *t)
+{
+	static char paste[4096];
+	int i;
+
+	memset(paste, 'p', sizeof(paste));
+	for (i = 0; i < 20; i++) {
+		trace_key(t, paste, sizeof(paste));
+		trace_str(t, "\r");
+	}
+}
+
+static void
+gen_bracketed_paste(struct trace *t)
+{
+	static char paste[4096 + 12];
+	int i;
+
+	memcpy(paste, "\033[200~", 6);
+	memset(paste + 6, 'p', 4096);
+	memcpy(paste + 6 + 4096, "\033[201~", 6);
+	for (i = 0; i < 20; i++) {
+		trace_key(t, paste, sizeof(paste));
+		trace_str(t, "\r");
+	}
+}
+
+static void
+gen_midline(struct trace *t)
+{
+	int i, j;
+
+	for (i = 0; i < 5; i++) {
+		trace_type(t, 1000);
+		trace_str(t, "\033[1~"); /* home */
+		for (j = 0; j < 200; j++) {
+			trace_str(t, "\033[C");
+			trace_str(t, "X");
+			trace_str(t, "\033[3~");
+		}
+		for (j = 0; j < 200; j++) {
+			trace_str(t, "\177");
+		}
+		trace_str(t, "\r");
+	}
+}
+
+static void
+gen_history(struct trace *t)
+{
+	int i;
+
+	for (i = 0; i < BENCH_HISTORY / 2; i++) {
+		trace_str(t, "\033[A");
+	}
+	for (i = 0; i < BENCH_HISTORY / 2; i++) {
+		trace_str(t, "\033[B");
+	}
+	trace_str(t, "\r");
+}
+
+static void
+gen_long_line(struct trace *t)
+{
+	int i;
+
+	trace_type(t, 64 * 1024);
+	for (i = 0; i < 100; i++) {
+		trace_str(t, "\033[1~"); /* home */
+		trace_str(t, "\033[4~"); /* end */
+	}
+	trace_str(t, "\r");
+}
+
+static struct {
+	const char *name;
+	void (*gen)(struct trace *t);
+} g_traces[] = {
+	{ "typing", gen_typing },
+	{ "paste", gen_paste },
+	{ "bracketed paste", gen_bracketed_paste },
+	{ "mid-line edits", gen_midline },
+	{ "history", gen_history },
+	{ "64 KB line", gen_long_line },
+};
+
+static int g_history_pos;
+
+static void
+history_cb(int dir, char *buf, size_t blen)
+{
+	int n = g_history_pos + dir;
+
+	if (n < 0 || n > BENCH_HISTORY) {
+		return;
+	}
+
+	g_history_pos = n;
+	if (n == BENCH_HISTORY) {
+		buf[0] = 0;
+	} else {
+		snprintf(buf, blen, "history entry number %d", n);
+	}
+}
+
+/* the editor side */
+static void
+editor_main(void)
+{
+	static char buf[BENCH_LINE_MAX];
+
+	do {
+		g_history_pos = BENCH_HISTORY;
+	} while (cli_gets(stdout, BENCH_PROMPT, buf, sizeof(buf), history_cb) >= 0);
+
+	exit(0);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* read/write syscalls made by the process so far */
+static uint64_t
+proc_syscalls(pid_t pid)
+{
+	char path[64], line[128];
+	uint64_t n = 0, val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "syscr: %" SCNu64, &val) == 1 ||
+		    sscanf(line, "syscw: %" SCNu64, &val) == 1) {
+			n += val;
+		}
+	}
+
+	fclose(f);
+	return n;
+}
+
+/* a tail of the output, to see if the prompt was printed */
+static char g_tail[64];
+static size_t g_tail_len;
+
+static void
+tail_append(const char *data, size_t len)
+{
+	size_t max = sizeof(g_tail) - 1;
+
+	if (len >= max) {
+		memcpy(g_tail, data + len - max, max);
+		g_tail_len = max;
+	} else {
+		if (g_tail_len + len > max) {
+			memmove(g_tail, g_tail + g_tail_len + len - max, max - len);
+			g_tail_len = max - len;
+		}
+		memcpy(g_tail + g_tail_len, data, len);
+		g_tail_len += len;
+	}
+	g_tail[g_tail_len] = 0;
+}
+
+/**
+ * Read whatever the editor printed. With a timeout, wait for at least
+ * one byte first.
+ */
+static size_t
+drain(int fd, int timeout_ms)
+{
+	static char buf[256 * 1024];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	size_t total = 0;
+	ssize_t rc;
+
+	while (poll(&pfd, 1, total == 0 ? timeout_ms : 0) > 0) {
+		rc = read(fd, buf, sizeof(buf));
+		if (rc <= 0) {
+			break;
+		}
+		total += rc;
+		tail_append(buf, rc);
+	}
+
+	return total;
+}
+
+/* wait until the editor prints its prompt and is ready for a new line */
+static size_t
+wait_prompt(int fd)
+{
+	size_t total = 0;
+	int tries = 0;
+
+	while (strstr(g_tail, BENCH_PROMPT " > ") == NULL && tries++ < 100) {
+		total += drain(fd, 10);
+	}
+	g_tail_len = 0;
+	g_tail[0] = 0;
+	return total;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+run_trace(struct trace *t)
+{
+	struct winsize ws = { 24, 80, 0, 0 };
+	uint64_t *lat, start, t0, sys0, sys1;
+	size_t i, off = 0, out = 0;
+	int fd, status;
+	pid_t pid;
+
+	lat = calloc(t->nkeys, sizeof(*lat));
+	if (lat == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	/* don't let the editor inherit anything buffered */
+	fflush(stdout);
+	pid = forkpty(&fd, NULL, NULL, &ws);
+	if (pid < 0) {
+		perror("forkpty");
+		exit(1);
+	} else if (pid == 0) {
+		editor_main();
+	}
+
+	wait_prompt(fd);
+	sys0 = proc_syscalls(pid);
+	start = now_ns();
+
+	for (i = 0; i < t->nkeys; i++) {
+		size_t len = t->ends[i] - off, got = 0;
+		ssize_t rc;
+
+		t0 = now_ns();
+		for (;;) {
+			rc = write(fd, t->buf + off, len);
+			if (rc <= 0) {
+				perror("write");
+				exit(1);
+			}
+			off += rc;
+			len -= rc;
+			if (len == 0) {
+				break;
+			}
+			/* don't let the pty fill up */
+			got += drain(fd, 0);
+		}
+		got += drain(fd, got ? 0 : 1000);
+		lat[i] = now_ns() - t0;
+		out += got;
+
+		if (t->buf[off - 1] == '\r') {
+			out += wait_prompt(fd);
+		}
+	}
+
+	out += drain(fd, 0);
+	sys1 = proc_syscalls(pid);
+	t0 = now_ns() - start;
+
+	/* end the editor with ctrl-d on an empty line */
+	if (write(fd, "\004", 1) != 1) {
+		perror("write");
+	}
+	drain(fd, 100);
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	close(fd);
+
+	qsort(lat, t->nkeys, sizeof(*lat), cmp_u64);
+	printf("%-16s %8zu %12.0f %12.1f %12.2f %10.1f %10.1f\n", t->name, t->nkeys,
+	       t->nkeys / (t0 / 1e9), (double)out / t->nkeys,
+	       (double)(sys1 - sys0) / t->nkeys,
+	       lat[t->nkeys / 2] / 1e3, lat[t->nkeys * 99 / 100] / 1e3);
+	fflush(stdout);
+	free(lat);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t i;
+	int j;
+
+	printf("%-16s %8s %12s %12s %12s %10s %10s\n", "trace", "keys", "keys/s",
+	       "out B/key", "syscalls/key", "p50 us", "p99 us");
+	for (i = 0; i < sizeof(g_traces) / sizeof(g_traces[0]); i++) {
+		struct trace t = { g_traces[i].name };
+
+		/* run only the traces given on the command line, if any */
+		for (j = 1; j < argc && strcmp(argv[j], t.name) != 0; j++);
+		if (argc > 1 && j == argc) {
+			continue;
+		}
+
+		g_traces[i].gen(&t);
+		run_trace(&t);
+		free(t.buf);
+		free(t.ends);
+	}
+
+	return 0;
+}
@@ -0,0 +1,789 @@
+/*-
+ * The MIT License
+ *
+ * Copyright 2019 Darek Stojaczyk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Stress tests of cli_gets() running on the other side of a pseudo-terminal.
+ *
+ * Each case is generated at a small and at a 4x larger size. The line read
+ * by the editor is checked against the expected one, and the time it took
+ * and the bytes the editor wrote must grow about linearly: 4x, certainly
+ * not the 16x of a quadratic loop.
+ *
+ * Then some keys are typed at a session to check what they do, and a few
+ * telnet clients misbehave towards a cli_server, which has to keep serving
+ * the others.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "cli_gets.h"
+
+#define CHECK_PROMPT "check"
+#define CHECK_SCALE 4
+/* max growth for CHECK_SCALE times the input; quadratic would be 16x */
+#define CHECK_MAX_BYTES 6.0
+#define CHECK_MAX_TIME 10.0
+/* shorter runs are too noisy to compare */
+#define CHECK_MIN_NS (1000000ULL)
+
+/* input for the editor, and the line it should produce */
+struct input {
+	char *buf;
+	size_t len;
+	size_t size;
+	char *line; /* expected line */
+	size_t line_len;
+	size_t line_size;
+	size_t blen; /* size of the buffer passed to cli_gets() */
+	size_t dropped; /* expected return value of cli_gets() */
+};
+
+static void
+grow(char **buf, size_t *size, size_t need)
+{
+	if (need <= *size) {
+		return;
+	}
+
+	*size = need * 2;
+	*buf = realloc(*buf, *size);
+	if (*buf == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+}
+
+static void
+input_add(struct input *in, const char *data, size_t len)
+{
+	grow(&in->buf, &in->size, in->len + len);
+	memcpy(in->buf + in->len, data, len);
+	in->len += len;
+}
+
+static void
+input_str(struct input *in, const char *str)
+{
+	input_add(in, str, strlen(str));
+}
+
+/* n characters of text, both typed and expected at pos of the line */
+static void
+input_text(struct input *in, size_t pos, size_t n)
+{
+	size_t i;
+	char c;
+
+	grow(&in->line, &in->line_size, in->line_len + n);
+	memmove(in->line + pos + n, in->line + pos, in->line_len - pos);
+	for (i = 0; i < n; i++) {
+		c = 'a' + i % 26;
+		input_add(in, &c, 1);
+		in->line[pos + i] = c;
+	}
+	in->line_len += n;
+}
+
+/* one big paste, without the bracketed paste mode */
+static void
+gen_paste(struct input *in, size_t n)
+{
+	input_text(in, 0, n);
+}
+
+static void
+gen_bracketed_paste(struct input *in, size_t n)
+{
+	input_str(in, "\033[200~");
+	input_text(in, 0, n);
+	input_str(in, "\033[201~");
+}
+
+/* insert characters in the middle of the line, one at a time */
+static void
+gen_midline(struct input *in, size_t n)
+{
+	size_t i;
+
+	input_text(in, 0, 100);
+	input_str(in, "\033[1~"); /* home */
+	for (i = 0; i < 50; i++) {
+		input_str(in, "\033[C");
+	}
+	for (i = 0; i < n; i++) {
+		/* X, then back before it */
+		input_str(in, "X\033[D");
+		grow(&in->line, &in->line_size, in->line_len + 1);
+		memmove(in->line + 51, in->line + 50, in->line_len - 50);
+		in->line[50] = 'X';
+		in->line_len++;
+	}
+}
+
+/* delete the line from the front */
+static void
+gen_home_delete(struct input *in, size_t n)
+{
+	size_t i;
+
+	input_text(in, 0, n + 10);
+	for (i = 0; i < n; i++) {
+		input_str(in, "\033[1~\033[3~"); /* home, delete */
+	}
+	memmove(in->line, in->line + n, 10);
+	in->line_len = 10;
+}
+
+/* a line much longer than the buffer */
+static void
+gen_overflow(struct input *in, size_t n)
+{
+	input_text(in, 0, n);
+	in->blen = 1024;
+	in->line_len = in->blen - 1;
+	in->dropped = n - in->line_len;
+}
+
+static struct {
+	const char *name;
+	void (*gen)(struct input *in, size_t n);
+	size_t n; /* the smaller size */
+} g_cases[] = {
+	{ "1 MB paste", gen_paste, 256 * 1024 },
+	{ "1 MB bracketed", gen_bracketed_paste, 256 * 1024 },
+	{ "10k mid-line", gen_midline, 10000 },
+	{ "home+delete", gen_home_delete, 10000 },
+	{ "overflow", gen_overflow, 256 * 1024 },
+};
+
+static uint32_t
+hash(const char *str, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)str[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* the editor side, reports each line it reads */
+static void
+editor_main(size_t blen)
+{
+	char *buf = malloc(blen);
+	int rc;
+
+	if (buf == NULL) {
+		exit(1);
+	}
+
+	while ((rc = cli_gets(stdout, CHECK_PROMPT, buf, blen, NULL)) >= 0) {
+		printf("result %zu %08x %d\r\n", strlen(buf), hash(buf, strlen(buf)), rc);
+		fflush(stdout);
+	}
+
+	exit(0);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* everything the editor printed for the current line */
+static char *g_out;
+static size_t g_out_len, g_out_size;
+
+/* read whatever is available, waiting up to timeout_ms for input */
+static int
+pump(int fd, const char *data, size_t *off, size_t len, int timeout_ms)
+{
+	struct pollfd pfd = { fd, POLLIN | (*off < len ? POLLOUT : 0), 0 };
+	ssize_t rc;
+
+	if (poll(&pfd, 1, timeout_ms) <= 0) {
+		return -1;
+	}
+
+	if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+		grow(&g_out, &g_out_size, g_out_len + 64 * 1024 + 1);
+		rc = read(fd, g_out + g_out_len, 64 * 1024);
+		if (rc <= 0) {
+			return -1;
+		}
+		g_out_len += rc;
+		g_out[g_out_len] = 0;
+	}
+
+	if (pfd.revents & POLLOUT) {
+		rc = write(fd, data + *off, len - *off);
+		if (rc > 0) {
+			*off += rc;
+		}
+	}
+	return 0;
+}
+
+/* wait for the given output of the editor */
+static const char *
+wait_for(int fd, const char *str)
+{
+	const char *found;
+	size_t off = 0;
+
+	while ((found = strstr(g_out, str)) == NULL) {
+		if (pump(fd, NULL, &off, 0, 10000) != 0) {
+			return NULL;
+		}
+	}
+	return found;
+}
+
+/**
+ * Feed the input to the editor and check the line it read.
+ *
+ * \param ns set to the time it took
+ * \param bytes set to the number of bytes written by the editor
+ * \return 0 if the line is right
+ */
+static int
+run(struct input *in, uint64_t *ns, size_t *bytes)
+{
+	struct winsize ws = { 24, 80, 0, 0 };
+	const char *res;
+	char expected[64];
+	size_t off = 0;
+	uint64_t start;
+	int fd, status, ok = 0;
+	pid_t pid;
+
+	*ns = 0;
+	*bytes = 0;
+	fflush(stdout);
+	pid = forkpty(&fd, NULL, NULL, &ws);
+	if (pid < 0) {
+		perror("forkpty");
+		exit(1);
+	} else if (pid == 0) {
+		editor_main(in->blen);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	g_out_len = 0;
+	grow(&g_out, &g_out_size, 1);
+	g_out[0] = 0;
+	if (wait_for(fd, CHECK_PROMPT " > ") == NULL) {
+		goto out;
+	}
+	g_out_len = 0;
+	g_out[0] = 0;
+
+	start = now_ns();
+	input_str(in, "\r");
+	while (off < in->len) {
+		if (pump(fd, in->buf, &off, in->len, 10000) != 0) {
+			goto out;
+		}
+	}
+	res = wait_for(fd, "result ");
+	if (res == NULL) {
+		goto out;
+	}
+	*ns = now_ns() - start;
+	*bytes = res - g_out;
+
+	/* the whole report, up to the next prompt */
+	if (wait_for(fd, CHECK_PROMPT " > ") == NULL) {
+		goto out;
+	}
+	res = g_out + *bytes;
+
+	snprintf(expected, sizeof(expected), "result %zu %08x %zu\r", in->line_len,
+		 hash(in->line, in->line_len), in->dropped);
+	ok = strncmp(res, expected, strlen(expected)) == 0;
+	if (!ok) {
+		printf("expected '%s', got '%.*s'\n", expected, (int)strcspn(res, "\r"), res);
+	}
+
+out:
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+/* candidates sharing the first character of the word, like a sloppy
+ * completion source would give */
+static void
+complete_words(struct cli_session *s, const char *line, size_t len, size_t cursor, void *arg)
+{
+	static const char *words[] = { "status ", "stash ", "commit " };
+	const char *cands[3];
+	size_t start = cursor, i, n = 0;
+
+	(void)len;
+	(void)arg;
+	while (start > 0 && line[start - 1] != ' ') {
+		start--;
+	}
+	for (i = 0; i < 3 && start < cursor; i++) {
+		if (words[i][0] == line[start]) {
+			cands[n++] = words[i];
+		}
+	}
+	cli_session_complete(s, start, cands, n);
+}
+
+static void
+setup_complete(struct cli_session *s)
+{
+	cli_session_set_completion(s, complete_words, NULL);
+}
+
+static void
+setup_history(struct cli_session *s)
+{
+	cli_session_set_history(s, 16, 4096);
+}
+
+static void
+setup_dedupe(struct cli_session *s)
+{
+	cli_session_set_history(s, 16, 4096);
+	cli_session_dedupe_history(s);
+}
+
+static void
+setup_suggest(struct cli_session *s)
+{
+	cli_session_set_history(s, 16, 4096);
+	cli_session_set_suggest(s, 1);
+}
+
+/* two messages, each shown on its own line above the one being edited */
+static int
+act_print(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_session_print(s, "<<one>>", 7);
+	cli_session_print(s, "<<two>>", 7);
+	cli_session_print_flush(s);
+	return CLI_NEED_MORE;
+}
+
+static void
+setup_print(struct cli_session *s)
+{
+	cli_bind_key(s, CLI_CTRL('t'), 0, act_print);
+}
+
+static void
+setup_timeout(struct cli_session *s)
+{
+	cli_session_set_timeout(s, 0, 200);
+}
+
+/* history file of the checks, created in main() */
+static char g_history[] = "/tmp/cli_gets_check.XXXXXX";
+
+/* a history file whose last line has no newline, e.g. cut short by a crash */
+static void
+setup_history_file(struct cli_session *s)
+{
+	int fd = open(g_history, O_WRONLY | O_TRUNC);
+
+	if (fd < 0 || write(fd, "no newline at end", 17) != 17) {
+		exit(1);
+	}
+	close(fd);
+	cli_session_set_history(s, 16, 4096);
+	cli_session_history_file(s, g_history);
+}
+
+/* the same file, as left by the previous check */
+static void
+setup_history_reload(struct cli_session *s)
+{
+	cli_session_set_history(s, 16, 4096);
+	cli_session_history_file(s, g_history);
+}
+
+static struct {
+	const char *name;
+	void (*setup)(struct cli_session *s);
+	const char *keys; /* ctrl-d at the end closes the session */
+	const char *lines; /* expected lines, each followed by \n */
+} g_behavior[] = {
+	{ "complete", setup_complete,
+	  "git st\t\r" "git stau\t\r" "git c\t\r" "git x\t\r" "\004",
+	  "git sta\n" "git stau\n" "git commit \n" "git x\n" },
+	/* a run of typed text is undone a word at a time, ctrl-_ and ctrl-^ */
+	{ "undo", NULL, "hello world\037\r" "ab cd\037\037\036\r" "\004", "hello\nab\n" },
+	{ "history", setup_history,
+	  "one\r" "two\r" "\033[A\033[A\r" "\033[A\033[A\033[B\r" "\004",
+	  "one\n" "two\n" "one\n" "one\n" },
+	{ "dedupe", setup_dedupe, "one\r" "two\r" "one\r" "\033[A\033[A\033[A\r" "\004",
+	  "one\n" "two\n" "one\n" "two\n" },
+	{ "ctrl-r", setup_history, "git status\r" "make check\r" "\022sta\r" "\004",
+	  "git status\n" "make check\n" "git status\n" },
+	/* the right arrow takes the suggestion */
+	{ "suggest", setup_suggest, "git status\r" "git s\033[C\r" "\004",
+	  "git status\n" "git status\n" },
+	{ "print", setup_print, "ab\024c\r" "\004", "one\n" "two\n" "abc\n" },
+	/* the line typed so far is dropped */
+	{ "idle timeout", setup_timeout, "x\r" "abc", "x\n" "timed out\n" },
+	{ "history file", setup_history_file, "new cmd\r" "\004", "new cmd\n" },
+	{ "history reload", setup_history_reload, "\033[A\033[A\r" "\033[A\033[A\r" "\004",
+	  "no newline at end\n" "new cmd\n" },
+};
+
+/* the editor side of the behavior checks, each line it reads is <<quoted>> */
+static void
+behavior_main(void (*setup)(struct cli_session *s))
+{
+	struct cli_session s;
+	const char *line;
+	size_t len;
+
+	if (cli_session_open(&s, stdout, CHECK_PROMPT, NULL) != 0) {
+		exit(1);
+	}
+	if (setup != NULL) {
+		setup(&s);
+	}
+
+	while ((line = cli_session_readline(&s, &len)) != NULL) {
+		printf("<<%.*s>>\r\n", (int)len, line);
+	}
+	if (cli_session_timed_out(&s)) {
+		/* the terminal isn't raw anymore, \n becomes \r\n */
+		printf("<<timed out>>\n");
+	}
+	cli_session_close(&s);
+	exit(0);
+}
+
+/* type the keys, and compare the lines read with the expected ones */
+static int
+behavior_run(void (*setup)(struct cli_session *s), const char *keys, const char *lines)
+{
+	struct winsize ws = { 24, 80, 0, 0 };
+	char *got = NULL, *p, *end;
+	size_t got_len = 0, got_size = 0, off = 0;
+	int fd, status, ok = 0;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = forkpty(&fd, NULL, NULL, &ws);
+	if (pid < 0) {
+		perror("forkpty");
+		exit(1);
+	} else if (pid == 0) {
+		behavior_main(setup);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	g_out_len = 0;
+	grow(&g_out, &g_out_size, 1);
+	g_out[0] = 0;
+	/* anything typed before the terminal is raw would be cooked */
+	if (wait_for(fd, CHECK_PROMPT " > ") == NULL) {
+		goto out;
+	}
+
+	/* until the session is closed */
+	while (pump(fd, keys, &off, strlen(keys), 10000) == 0) {
+	}
+
+	for (p = g_out; (p = strstr(p, "<<")) != NULL; p = end + 2) {
+		end = strstr(p, ">>\r\n");
+		if (end == NULL) {
+			break;
+		}
+		grow(&got, &got_size, got_len + (end - p) + 1);
+		memcpy(got + got_len, p + 2, end - p - 2);
+		got_len += end - p - 2;
+		got[got_len++] = '\n';
+	}
+
+	ok = got_len == strlen(lines) && memcmp(got, lines, got_len) == 0;
+	if (!ok) {
+		printf("expected '%s', got '%.*s'\n", lines, (int)got_len, got ? got : "");
+	}
+
+out:
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	close(fd);
+	free(got);
+	return ok ? 0 : -1;
+}
+
+/* the server side of the telnet checks, replies "got <line>" to each line */
+static struct cli_server g_srv;
+
+static int
+server_line(struct cli_session *s, const char *line, size_t len, void *arg)
+{
+	int *open = arg;
+	char reply[64];
+	int n;
+
+	if (line == NULL) {
+		cli_server_remove(&g_srv, s);
+		close(cli_session_fd(s));
+		cli_session_close(s);
+		(*open)--;
+		return 1;
+	}
+
+	n = snprintf(reply, sizeof(reply), "got %.*s\r\n", (int)len, line);
+	if (n >= (int)sizeof(reply)) {
+		n = sizeof(reply) - 1;
+	}
+	if (send(cli_session_fd(s), reply, n, MSG_DONTWAIT) < 0) {
+		/* it doesn't read, but that's no reason to block */
+	}
+	return 0;
+}
+
+static void
+server_main(int fd_a, int fd_b)
+{
+	struct cli_session s[2];
+	int open = 2;
+
+	if (cli_server_open(&g_srv) != 0) {
+		exit(1);
+	}
+	cli_session_open_telnet(&s[0], fd_a, CHECK_PROMPT, NULL);
+	cli_session_open_telnet(&s[1], fd_b, CHECK_PROMPT, NULL);
+	cli_server_add(&g_srv, &s[0]);
+	cli_server_add(&g_srv, &s[1]);
+	while (open > 0 && cli_server_run(&g_srv, -1, server_line, &open) >= 0) {
+	}
+
+	exit(0);
+}
+
+/* whether the server closes the connection */
+static int
+wait_closed(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char buf[4096];
+	ssize_t rc;
+
+	do {
+		if (poll(&pfd, 1, 10000) <= 0) {
+			return -1;
+		}
+		rc = read(fd, buf, sizeof(buf));
+	} while (rc > 0 || (rc < 0 && errno == EAGAIN));
+	return rc == 0 ? 0 : -1;
+}
+
+/* send a string and wait for the given reply */
+static int
+chat(int fd, const char *str, const char *reply)
+{
+	g_out_len = 0;
+	g_out[0] = 0;
+	if (write(fd, str, strlen(str)) != (ssize_t)strlen(str)) {
+		return -1;
+	}
+	return wait_for(fd, reply) ? 0 : -1;
+}
+
+/* ctrl-c and IAC IP end the session, but not the server */
+static int
+telnet_interrupt(int a, int b)
+{
+	if (chat(a, "hi\r", "got hi\r\n") != 0 || write(a, "\003", 1) != 1 ||
+	    wait_closed(a) != 0) {
+		return -1;
+	}
+	if (chat(b, "ok\r", "got ok\r\n") != 0 || write(b, "\377\364", 2) != 2 ||
+	    wait_closed(b) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* 0xFF typed by the client comes in doubled, and is echoed doubled too */
+static int
+telnet_iac(int a, int b)
+{
+	char *reply;
+
+	(void)b;
+	if (chat(a, "x\377\377y\r", "got x\377y\r\n") != 0) {
+		return -1;
+	}
+	/* just the echo, before the reply */
+	reply = strstr(g_out, "got ");
+	*reply = 0;
+	return strstr(g_out, "x\377\377y") ? 0 : -1;
+}
+
+/* a client that doesn't read its output doesn't stall the other */
+static int
+telnet_stall(int a, int b)
+{
+	struct pollfd pfd = { a, POLLOUT, 0 };
+	char chunk[4096];
+	size_t i;
+
+	for (i = 0; i < sizeof(chunk); i++) {
+		chunk[i] = i % 64 == 63 ? '\r' : 'a' + i % 26;
+	}
+	/* until the server stops taking it */
+	while (poll(&pfd, 1, 500) > 0) {
+		if (write(a, chunk, sizeof(chunk)) < 0 && errno != EAGAIN) {
+			return -1;
+		}
+	}
+	return chat(b, "ok\r", "got ok\r\n");
+}
+
+static struct {
+	const char *name;
+	int (*run)(int a, int b); /* with the clients' sockets */
+} g_telnet_cases[] = {
+	{ "telnet ctrl-c", telnet_interrupt },
+	{ "telnet stall", telnet_stall },
+	{ "telnet 0xff", telnet_iac },
+};
+
+/* run the case against a server in a child process */
+static int
+telnet_run(int (*fn)(int a, int b))
+{
+	int a[2], b[2], status, rc;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, a) != 0 ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, b) != 0) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	} else if (pid == 0) {
+		close(a[0]);
+		close(b[0]);
+		server_main(a[1], b[1]);
+	}
+	close(a[1]);
+	close(b[1]);
+	fcntl(a[0], F_SETFL, fcntl(a[0], F_GETFL) | O_NONBLOCK);
+	fcntl(b[0], F_SETFL, fcntl(b[0], F_GETFL) | O_NONBLOCK);
+
+	grow(&g_out, &g_out_size, 1);
+	rc = fn(a[0], b[0]);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	close(a[0]);
+	close(b[0]);
+	return rc;
+}
+
+int
+main(void)
+{
+	size_t i, j, bytes[2];
+	uint64_t ns[2];
+	double time_growth, bytes_growth;
+	int failed = 0, rc;
+
+	signal(SIGPIPE, SIG_IGN);
+	printf("%-16s %8s %10s %10s %10s %10s  %s\n", "case", "n", "ms", "4n ms", "bytes",
+	       "4n bytes", "result");
+	for (i = 0; i < sizeof(g_cases) / sizeof(g_cases[0]); i++) {
+		rc = 0;
+		for (j = 0; j < 2; j++) {
+			struct input in = { 0 };
+
+			in.blen = 4 * 1024 * 1024;
+			g_cases[i].gen(&in, g_cases[i].n * (j ? CHECK_SCALE : 1));
+			rc |= run(&in, &ns[j], &bytes[j]);
+			free(in.buf);
+			free(in.line);
+		}
+
+		time_growth = (double)(ns[1] > CHECK_MIN_NS ? ns[1] : CHECK_MIN_NS) /
+			      (ns[0] > CHECK_MIN_NS ? ns[0] : CHECK_MIN_NS);
+		bytes_growth = (double)bytes[1] / (bytes[0] ? bytes[0] : 1);
+		if (rc == 0 && (time_growth > CHECK_MAX_TIME || bytes_growth > CHECK_MAX_BYTES)) {
+			rc = -1;
+		}
+
+		printf("%-16s %8zu %10.1f %10.1f %10zu %10zu  %s\n", g_cases[i].name, g_cases[i].n,
+		       ns[0] / 1e6, ns[1] / 1e6, bytes[0], bytes[1], rc ? "FAIL" : "ok");
+		fflush(stdout);
+		failed |= rc;
+	}
+
+	rc = mkstemp(g_history);
+	if (rc < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(rc);
+	for (i = 0; i < sizeof(g_behavior) / sizeof(g_behavior[0]); i++) {
+		rc = behavior_run(g_behavior[i].setup, g_behavior[i].keys, g_behavior[i].lines);
+		printf("%-16s %8s %10s %10s %10s %10s  %s\n", g_behavior[i].name, "-", "-", "-", "-",
+		       "-", rc ? "FAIL" : "ok");
+		fflush(stdout);
+		failed |= rc;
+	}
+	unlink(g_history);
+
+	for (i = 0; i < sizeof(g_telnet_cases) / sizeof(g_telnet_cases[0]); i++) {
+		rc = telnet_run(g_telnet_cases[i].run);
+		printf("%-16s %8s %10s %10s %10s %10s  %s\n", g_telnet_cases[i].name, "-", "-", "-",
+		       "-", "-", rc ? "FAIL" : "ok");
+		fflush(stdout);
+		failed |= rc;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -22,11 +22,34 @@
  * THE SOFTWARE.
  */
 
+#ifndef CLI_GETS_H
+#define CLI_GETS_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /**
  * Get either next or previous command.
@@ -41,159 +64,4989 @@
  */
 typedef void (*cli_history_cb)(int dir, char *buf, size_t blen);
 
+/*
+ * Optional features, all enabled by default. Defining one to 0 compiles it
+ * out: the API stays the same, but the related calls do nothing or fail.
+ * There is no multibyte support to select, bytes are edited as they are.
+ */
+#ifndef CLI_GETS_STATS
+/* set to 0 to compile out all cli_stats accounting */
+#define CLI_GETS_STATS 1
+#endif
+
+#ifndef CLI_GETS_HISTORY
+/* the built-in history, its file, the ctrl-r search and the suggestions;
+ * cli_history_cb still works without it */
+#define CLI_GETS_HISTORY 1
+#endif
+
+#ifndef CLI_GETS_ESCAPES
+/* special keys (arrows, home, delete, alt-...) and the bracketed paste;
+ * without it their escape sequences are just skipped, and only the
+ * control keys edit the line */
+#define CLI_GETS_ESCAPES 1
+#endif
+
 /**
- * gets() with arrow-navigation, backspace, history, home/end buttons support, etc.
+ * Counters of what the editor has been doing, to tell whether any slowness
+ * comes from the terminal link or from the editor itself. They're only
+ * updated for sessions given to cli_session_set_stats().
+ */
+struct cli_stats {
+	uint64_t bytes_read; /* input bytes processed */
+	uint64_t bytes_written; /* output bytes sent to the terminal */
+	uint64_t reads; /* read() syscalls */
+	uint64_t writes; /* write() syscalls */
+	uint64_t full_redraws; /* frames with the whole line (and prompt) redrawn */
+	uint64_t incremental_redraws; /* frames with just the changes */
+	uint64_t escapes; /* escape sequences parsed */
+	uint64_t history_cb_calls;
+	uint64_t bytes_dropped; /* input bytes that didn't fit in the line */
+	uint64_t loop_ns; /* time spent processing the input */
+};
+
+static inline uint64_t
+cli_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if CLI_GETS_STATS
+#define CLI_STAT_ADD(s, field, n) \
+	do { if ((s)->stats) (s)->stats->field += (n); } while (0)
+#define CLI_STAT_TIMER(s, t) \
+	uint64_t t = (s)->stats ? cli_now_ns() : 0
+#define CLI_STAT_ELAPSED(s, field, t) \
+	CLI_STAT_ADD(s, field, cli_now_ns() - (t))
+#else
+#define CLI_STAT_ADD(s, field, n) do { (void)(n); } while (0)
+#define CLI_STAT_TIMER(s, t)
+#define CLI_STAT_ELAPSED(s, field, t) do { } while (0)
+#endif
+
+/* max output kept for a telnet client that doesn't read it */
+#define CLI_OUTPUT_BACKLOG_MAX (16 * 1024)
+
+/**
+ * Output for the terminal. Everything making up a single frame (the prompt,
+ * the line, any cursor movement) is put here first and then sent with a
+ * single write(), so the terminal never shows a half-drawn line and there
+ * is just one syscall per frame.
  *
- * \param f_out FILE for printing the user input. Usually stdout or stderr.
- * \param str Any custom string to print before the command prompt.
- *        Must be null-terminated.
- * \param buf Buffer where the user input will be put. It will always be
- *        null-terminated.
- * \param blen Max size of buf (including the null terminator).
- * \param history_cb function to retrieve previous/next user command whenever the
- *        up or down key is pressed. This callback is optional, can be NULL. Then
- *        up/down keys simply won't do anything.
+ * Sockets are never waited for. Whatever the client doesn't take right
+ * away stays in buf, and is sent before the next frame.
  */
-static void
-cli_gets(FILE *f_out, char *str, char *buf, size_t blen, cli_history_cb history_cb)
+struct cli_output {
+	char *buf;
+	size_t len;
+	size_t size; /* allocated size of buf */
+	int fd;
+	int sock; /* fd is a socket, don't get SIGPIPE if it's closed */
+	int telnet; /* 0xFF is doubled, as it's a telnet command otherwise */
+	int lost; /* the backlog of a socket grew too big, nothing is sent anymore */
+	int polling; /* cli_server waits for fd to become writable */
+};
+
+static inline void
+cli_out_append(struct cli_output *out, const void *data, size_t n)
 {
-	unsigned char b;
-	int len = 0, off = 0, pad = 0;
-	struct termios oldt, newt;
+	if (n == 0) {
+		return;
+	}
 
-	/* terminate any previous (or junk) data */
-	buf[0] = 0;
+	if (out->len + n > out->size) {
+		size_t size = out->size ? out->size : 256;
+		char *buf;
 
-	fprintf(f_out, "\xD%s > ", str);
+		while (size < out->len + n) {
+			size *= 2;
+		}
 
-	/* to detect arrow key presses etc. we'll switch the current user terminal
-	 * to the "raw" mode where all special processing of input characters is
-	 * disabled. Before we do that, let's save the previous configuration so
-	 * we'll be able to restore it later */
-	tcgetattr(STDIN_FILENO, &oldt);
-	newt = oldt;
-	cfmakeraw(&newt);
-	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+		buf = (char *)realloc(out->buf, size);
+		if (buf == NULL) {
+			/* the frame will be incomplete */
+			return;
+		}
+		out->buf = buf;
+		out->size = size;
+	}
+
+	memcpy(out->buf + out->len, data, n);
+	out->len += n;
+}
+
+static inline void
+cli_out_write(struct cli_output *out, const void *data, size_t n)
+{
+	const char *p = (const char *)data;
+	const char *iac;
+	size_t len;
+
+	/* telnet would take 0xFF for the start of a command */
+	while (out->telnet && n > 0 && (iac = (const char *)memchr(p, 0xFF, n)) != NULL) {
+		len = iac - p + 1;
+		cli_out_append(out, p, len);
+		cli_out_append(out, iac, 1);
+		p += len;
+		n -= len;
+	}
+	cli_out_append(out, p, n);
+}
+
+static inline void
+cli_out_str(struct cli_output *out, const char *str)
+{
+	cli_out_write(out, str, strlen(str));
+}
 
+/* ESC [ n <final>, e.g. a cursor movement */
+static inline void
+cli_out_csi(struct cli_output *out, size_t n, char final)
+{
+	char tmp[32];
+	char *p = tmp + sizeof(tmp);
+
+	*--p = final;
 	do {
-		b = getchar();
-		switch (b) {
-		case 0x3: /* ctrl-c */
-		case 0x1a: /* ctrl-z */
-			tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-			fprintf(f_out, "\n");
-			exit(b == 0x3 ? 0 : 1);
-			break;
-		case 0x1b: /* escaped sequence */ {
-			char b2, b3;
-
-			b2 = getchar();
-			b3 = getchar();
-
-			if (b2 == 0x5b) {
-				if (b3 == 68) { /* left */
-					off++;
-					if (off > len) off = len;
-				} else if (b3 == 67) { /* right */
-					off--;
-					if (off < 0) off = 0;
-				} else if (b3 == 66) { /* down */
-					if (history_cb) {
-						history_cb(1, buf, blen);
-						len = strlen(buf);
-						off = 0;
-						pad = 0;
-					}
-				} else if (b3 == 65) { /* up */
-					if (history_cb) {
-						history_cb(-1, buf, blen);
-						len = strlen(buf);
-						off = 0;
-						pad = 0;
-					}
-				} else if (b3 == 49) { /* home */
-					getchar(); /* dummy */
-					off = -len;
-				} else if (b3 == 51) { /* delete */
-					int i;
-
-					getchar(); /* dummy */
-					/* if there is a character at the cursor */
-					if (off > 0) {
-						/* shift the character at the right side of cursor to the left */
-						for (i = len - off; i < len - 1; i++) {
-							buf[i] = buf[i + 1];
-						}
-						/* replace the last char with a space */
-						buf[len - 1] = ' ';
-						len--;
-						pad++;
-						off--;
-					}
-				} else if (b3 == 52) { /* end */
-					getchar(); /* dummy */
-					off = 0;
-				}
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	*--p = '[';
+	*--p = '\033';
+
+	cli_out_write(out, p, tmp + sizeof(tmp) - p);
+}
+
+/**
+ * Send everything to the terminal, or as much as a socket takes without
+ * blocking.
+ *
+ * \return number of write() calls it took
+ */
+static inline unsigned
+cli_out_flush(struct cli_output *out)
+{
+	unsigned writes = 0;
+	size_t off = 0;
+	ssize_t rc;
+
+	while (off < out->len && !out->lost) {
+		writes++;
+#ifdef MSG_NOSIGNAL
+		if (out->sock) {
+			rc = send(out->fd, out->buf + off, out->len - off, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} else
+#endif
+		rc = write(out->fd, out->buf + off, out->len - off);
+		if (rc < 0 && errno == EAGAIN && out->sock) {
+			/* keep the rest for later */
+			out->len -= off;
+			memmove(out->buf, out->buf + off, out->len);
+			if (out->len > CLI_OUTPUT_BACKLOG_MAX) {
+				out->lost = 1;
+				break;
 			}
+			return writes;
+		} else if (rc < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { out->fd, POLLOUT, 0 };
 
+			poll(&pfd, 1, -1);
+			continue;
+		} else if (rc < 0 && errno == EINTR) {
+			continue;
+		} else if (rc <= 0) {
 			break;
 		}
-		case 0x7F: /* backspace */ {
-			int i;
+		off += rc;
+	}
 
-			/* if there are character behind the cursor */
-			if (len - off > 0) {
-				/* shift the character at the cursor to the left */
-				for (i = len - off - 1; i < len - 1; i++) {
-					buf[i] = buf[i + 1];
-				}
-				/* replace the last char with a space */
-				buf[len - 1] = ' ';
-				len--;
-				pad++;
-			}
-			break;
+	out->len = 0;
+	return writes;
+}
+
+/**
+ * The line being edited, stored as a gap buffer. The gap is always kept
+ * at the cursor, so inserting or deleting characters there is O(1). Only
+ * moving the cursor shifts the text, and then just across the distance
+ * it was moved. Once the gap is used up, the buffer doubles in size, so
+ * appending stays amortized O(1) for lines of any length.
+ */
+struct cli_line {
+	char *buf;
+	size_t size; /* allocated size of buf, the gap ends here if it's empty */
+	size_t max; /* max length of the line */
+	size_t gap; /* start of the gap, which is also the cursor position */
+	size_t end; /* end of the gap, the rest of the line follows */
+};
+
+/* no limit for the line length, see cli_session_set_line_max() */
+#define CLI_LINE_UNLIMITED ((size_t)-1)
+
+/* initial size of the line buffer */
+#define CLI_LINE_CHUNK 256
+
+static inline size_t
+cli_line_len(const struct cli_line *l)
+{
+	return l->size - (l->end - l->gap);
+}
+
+/* whether nothing more can be inserted */
+static inline int
+cli_line_full(const struct cli_line *l)
+{
+	return cli_line_len(l) >= l->max;
+}
+
+/**
+ * Empty the line and limit it to max characters. The buffer is kept,
+ * so it's not allocated again for every line.
+ */
+static inline void
+cli_line_reset(struct cli_line *l, size_t max)
+{
+	l->max = max;
+	l->gap = 0;
+	l->end = l->size;
+}
+
+/**
+ * Make sure the gap has room for at least n characters, growing the
+ * buffer geometrically if it doesn't.
+ *
+ * \return 0 on success, -1 if the memory couldn't be allocated
+ */
+static inline int
+cli_line_reserve(struct cli_line *l, size_t n)
+{
+	size_t len = cli_line_len(l), tail = l->size - l->end;
+	size_t size = l->size > 0 ? l->size : CLI_LINE_CHUNK;
+	char *buf;
+
+	if (l->end - l->gap >= n) {
+		return 0;
+	}
+
+	while (size - len < n) {
+		if (size > (size_t)-1 / 2) {
+			return -1;
 		}
-		case 0xD: /* carriage return */
-			off = 0;
-			/* fall-through */
-		default:
-			if (off != 0) {
-				int i;
+		size *= 2;
+	}
 
-				/* shift characters at the cursor to the right */
-				for (i = len; i > len - off; i--) {
-					buf[i] = buf[i - 1];
-				}
-			}
+	buf = (char *)realloc(l->buf, size);
+	if (buf == NULL) {
+		return -1;
+	}
 
-			buf[len - off] = b;
-			buf[len + 1] = 0;
-			len++;
-			pad = 0;
-			break;
+	/* the text after the gap stays at the end of the buffer */
+	memmove(buf + size - tail, buf + l->end, tail);
+	l->buf = buf;
+	l->end = size - tail;
+	l->size = size;
+	return 0;
+}
+
+/* get the character at the given position */
+static inline char
+cli_line_at(const struct cli_line *l, size_t pos)
+{
+	return l->buf[pos < l->gap ? pos : pos + (l->end - l->gap)];
+}
+
+/* find the start of the previous word (dir < 0) or the end of the next one */
+static inline size_t
+cli_line_word(const struct cli_line *l, int dir)
+{
+	size_t pos = l->gap, len = cli_line_len(l);
+
+	if (dir < 0) {
+		while (pos > 0 && cli_line_at(l, pos - 1) == ' ') {
+			pos--;
+		}
+		while (pos > 0 && cli_line_at(l, pos - 1) != ' ') {
+			pos--;
+		}
+	} else {
+		while (pos < len && cli_line_at(l, pos) == ' ') {
+			pos++;
+		}
+		while (pos < len && cli_line_at(l, pos) != ' ') {
+			pos++;
+		}
+	}
+
+	return pos;
+}
+
+/* move the gap (and the cursor) to the given position */
+static inline void
+cli_line_move(struct cli_line *l, size_t pos)
+{
+	if (pos < l->gap) {
+		size_t n = l->gap - pos;
+
+		memmove(l->buf + l->end - n, l->buf + pos, n);
+		l->gap -= n;
+		l->end -= n;
+	} else if (pos > l->gap) {
+		size_t n = pos - l->gap;
+
+		memmove(l->buf + l->gap, l->buf + l->end, n);
+		l->gap += n;
+		l->end += n;
+	}
+}
+
+/* insert a character at the cursor, returns -1 if the line is full */
+static inline int
+cli_line_insert(struct cli_line *l, char c)
+{
+	if (cli_line_full(l) || cli_line_reserve(l, 1) != 0) {
+		return -1;
+	}
+
+	l->buf[l->gap++] = c;
+	return 0;
+}
+
+/* insert up to n characters at the cursor, returns how many did fit */
+static inline size_t
+cli_line_insert_n(struct cli_line *l, const char *str, size_t n)
+{
+	size_t room = l->max - cli_line_len(l);
+
+	if (n > room) {
+		n = room;
+	}
+
+	if (cli_line_reserve(l, n) != 0) {
+		n = l->end - l->gap;
+	}
+
+	if (n > 0) {
+		/* a fresh line has no buffer yet */
+		memcpy(l->buf + l->gap, str, n);
+		l->gap += n;
+	}
+	return n;
+}
+
+/**
+ * Copy the line to a null-terminated buffer of at least cli_line_len() + 1
+ * bytes. The gap doesn't need to be closed for this.
+ */
+static inline void
+cli_line_copy(const struct cli_line *l, char *dst)
+{
+	if (l->buf != NULL) {
+		memcpy(dst, l->buf, l->gap);
+		memcpy(dst + l->gap, l->buf + l->end, l->size - l->end);
+	}
+	dst[cli_line_len(l)] = 0;
+}
+
+/* replace the whole line, put the cursor at the end */
+static inline void
+cli_line_set(struct cli_line *l, const char *src, size_t len)
+{
+	l->gap = 0;
+	l->end = l->size;
+	cli_line_insert_n(l, src, len);
+}
+
+/* print characters in the [from, to) range of the line */
+static inline void
+cli_line_write(const struct cli_line *l, struct cli_output *out, size_t from, size_t to)
+{
+	if (from < l->gap) {
+		size_t n = (to < l->gap ? to : l->gap) - from;
+
+		cli_out_write(out, l->buf + from, n);
+		from += n;
+	}
+
+	if (from < to) {
+		cli_out_write(out, l->buf + from + (l->end - l->gap), to - from);
+	}
+}
+
+/* values of cli_screen.op */
+#define CLI_OP_NONE 0 /* nothing has changed */
+#define CLI_OP_INSERT 1 /* a single run of characters was inserted */
+#define CLI_OP_DELETE 2 /* a single run of characters was deleted */
+#define CLI_OP_MIXED 3 /* anything else, everything from op_pos is stale */
+
+/**
+ * What is currently displayed after the prompt and what has changed
+ * in the line since it was last drawn. This lets us send just the difference
+ * to the terminal instead of reprinting the whole line after every key.
+ */
+struct cli_screen {
+	size_t len; /* number of characters displayed after the prompt */
+	size_t cur; /* cursor position, relative to the end of the prompt */
+	int op; /* CLI_OP_* */
+	size_t op_pos; /* first changed character */
+	size_t op_len; /* number of characters inserted or deleted at op_pos */
+	int prompt_dirty; /* the prompt has changed, redraw everything */
+	const char *ghost; /* suggestion displayed after the line */
+	size_t ghost_len;
+	size_t width; /* columns left for the line after the prompt, 0 if unlimited */
+	size_t off; /* first character displayed, when the line doesn't fit */
+};
+
+/* end of the displayed part of the line */
+static inline size_t
+cli_screen_end(const struct cli_screen *scr)
+{
+	if (scr->width > 0 && scr->len > scr->off + scr->width) {
+		return scr->off + scr->width;
+	}
+	return scr->len;
+}
+
+static inline void
+cli_screen_invalidate(struct cli_screen *scr, size_t pos)
+{
+	if (scr->op == CLI_OP_NONE || pos < scr->op_pos) {
+		scr->op_pos = pos;
+	}
+	scr->op = CLI_OP_MIXED;
+}
+
+/* n characters were inserted at pos */
+static inline void
+cli_screen_insert(struct cli_screen *scr, size_t pos, size_t n)
+{
+	if (scr->op == CLI_OP_NONE) {
+		scr->op = CLI_OP_INSERT;
+		scr->op_pos = pos;
+		scr->op_len = n;
+	} else if (scr->op == CLI_OP_INSERT && pos == scr->op_pos + scr->op_len) {
+		/* typing continues */
+		scr->op_len += n;
+	} else {
+		cli_screen_invalidate(scr, pos);
+	}
+}
+
+/* n characters were deleted at pos */
+static inline void
+cli_screen_delete(struct cli_screen *scr, size_t pos, size_t n)
+{
+	if (scr->op == CLI_OP_NONE) {
+		scr->op = CLI_OP_DELETE;
+		scr->op_pos = pos;
+		scr->op_len = n;
+	} else if (scr->op == CLI_OP_DELETE && pos + n == scr->op_pos) {
+		/* repeated backspace */
+		scr->op_pos = pos;
+		scr->op_len += n;
+	} else if (scr->op == CLI_OP_DELETE && pos == scr->op_pos) {
+		/* repeated delete */
+		scr->op_len += n;
+	} else {
+		cli_screen_invalidate(scr, pos);
+	}
+}
+
+/* attributes of a part of the line, see cli_highlight_cb */
+struct cli_span {
+	size_t start;
+	size_t len;
+	unsigned char attr; /* index in the palette, 0 for the default look */
+};
+
+/* max number of spans returned by cli_highlight_cb at once */
+#define CLI_HIGHLIGHT_SPANS 64
+
+/**
+ * Called before drawing the line to get the attributes of what has changed.
+ * Characters in the [from, to) range that aren't covered by any span get the
+ * default attribute, and characters outside of it keep theirs, unless they're
+ * covered. E.g. when a word was extended, all of it should be returned.
+ *
+ * \param line the whole line, not null-terminated
+ * \param len length of the line
+ * \param from first changed character
+ * \param to end of the changed range. It's equal to from if something was
+ *        just deleted there.
+ * \param spans where to put the attributes
+ * \param max capacity of spans, CLI_HIGHLIGHT_SPANS
+ * \param arg argument given to cli_session_set_highlight()
+ * \return number of returned spans
+ */
+typedef size_t (*cli_highlight_cb)(const char *line, size_t len, size_t from, size_t to,
+				   struct cli_span *spans, size_t max, void *arg);
+
+/**
+ * Syntax highlighting of the line. The attributes of each character are
+ * kept both as they should be and as they're shown, so only the
+ * changed ones need to be redrawn.
+ */
+struct cli_highlight {
+	cli_highlight_cb cb;
+	void *arg;
+	const char *const *palette; /* SGR parameters of each attribute, e.g. "1;31" */
+	size_t npalette;
+	unsigned char *attr; /* wanted attributes of the line */
+	unsigned char *shown; /* attributes currently on the screen */
+	size_t size; /* allocated size of attr and shown */
+	size_t lo, hi; /* the range of possibly changed attributes */
+};
+
+/* FNV-1a of the line, like cli_history_hash() */
+static inline uint64_t
+cli_line_hash(const struct cli_line *l)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i, len = cli_line_len(l);
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)cli_line_at(l, i)) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* print the [from, to) range of the line with its attributes */
+static inline void
+cli_highlight_write(struct cli_output *out, struct cli_highlight *hl, const struct cli_line *l,
+		    size_t from, size_t to)
+{
+	unsigned char cur = 0;
+	size_t i, j;
+
+	if (from >= to) {
+		return;
+	}
+
+	for (i = from; i < to; i = j) {
+		for (j = i + 1; j < to && hl->attr[j] == hl->attr[i]; j++);
+		if (hl->attr[i] != cur) {
+			cur = hl->attr[i];
+			cli_out_str(out, "\033[0;");
+			cli_out_str(out, cur ? hl->palette[cur] : "");
+			cli_out_str(out, "m");
+		}
+		cli_line_write(l, out, i, j);
+	}
+
+	if (cur != 0) {
+		cli_out_str(out, "\033[m");
+	}
+	memcpy(hl->shown + from, hl->attr + from, to - from);
+}
+
+/* print the [from, to) range of the line, highlighted if hl is given */
+static inline void
+cli_redraw_write(struct cli_output *out, struct cli_highlight *hl, const struct cli_line *l,
+		 size_t from, size_t to)
+{
+	if (hl) {
+		cli_highlight_write(out, hl, l, from, to);
+	} else {
+		cli_line_write(l, out, from, to);
+	}
+}
+
+static inline void
+cli_move_cursor(struct cli_output *out, size_t from, size_t to)
+{
+	if (to < from) {
+		cli_out_csi(out, from - to, 'D');
+	} else if (to > from) {
+		cli_out_csi(out, to - from, 'C');
+	}
+}
+
+/**
+ * cli_redraw() for a line that is wider than the terminal. Just the part
+ * around the cursor is displayed, and it scrolls by half of its width when
+ * the cursor leaves it, so a frame is never longer than the width.
+ */
+static inline void
+cli_redraw_window(struct cli_output *out, struct cli_screen *scr, const struct cli_line *l,
+		  size_t cur, struct cli_highlight *hl)
+{
+	size_t len = cli_line_len(l), width = scr->width, off = scr->off, from = len + 1;
+	size_t end, right = off + width, i, j;
+	int clear = 1;
+
+	if (len <= width) {
+		off = 0;
+	} else if (cur < off || cur > off + width) {
+		off = cur > width / 2 ? cur - width / 2 : 0;
+	}
+	end = len < off + width ? len : off + width;
+
+	if (off != scr->off) {
+		/* scrolled, draw all of it */
+		from = off;
+	} else if (scr->op == CLI_OP_INSERT && scr->op_pos >= off && scr->op_pos == scr->len) {
+		/* typed at the end */
+		from = scr->op_pos;
+		clear = 0;
+	} else if (scr->op == CLI_OP_INSERT && scr->op_pos >= off && scr->op_pos + scr->op_len < right) {
+		cli_move_cursor(out, scr->cur, scr->op_pos);
+		cli_out_csi(out, scr->op_len, '@');
+		cli_redraw_write(out, hl, l, scr->op_pos, scr->op_pos + scr->op_len);
+		scr->cur = scr->op_pos + scr->op_len;
+		if (cli_screen_end(scr) + scr->op_len > right) {
+			/* whatever was pushed past the last column */
+			cli_move_cursor(out, scr->cur, right);
+			cli_out_str(out, "\033[K");
+			scr->cur = right;
+		}
+	} else if (scr->op == CLI_OP_DELETE && scr->op_pos >= off && scr->op_pos < right) {
+		cli_move_cursor(out, scr->cur, scr->op_pos);
+		cli_out_csi(out, scr->op_len, 'P');
+		scr->cur = scr->op_pos;
+		/* the characters that moved into view from the right */
+		from = scr->op_pos + scr->op_len < right ? right - scr->op_len : scr->op_pos;
+		clear = 0;
+	} else if (scr->op != CLI_OP_NONE) {
+		from = scr->op_pos > off ? scr->op_pos : off;
+	}
+
+	if (from <= end) {
+		cli_move_cursor(out, scr->cur - scr->off, from - off);
+		cli_redraw_write(out, hl, l, from, end);
+		if (clear) {
+			cli_out_str(out, "\033[K");
+			scr->ghost_len = 0;
+		}
+		scr->cur = end;
+		scr->off = off;
+	}
+
+	/* the displayed characters with new attributes */
+	for (i = hl && hl->lo > off ? hl->lo : off; hl && i < hl->hi && i < end; i = j) {
+		if (hl->attr[i] == hl->shown[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < hl->hi && j < end && hl->attr[j] != hl->shown[j]; j++);
+		cli_move_cursor(out, scr->cur, i);
+		cli_highlight_write(out, hl, l, i, j);
+		scr->cur = j;
+	}
+
+	scr->op = CLI_OP_NONE;
+	scr->len = len;
+	cli_move_cursor(out, scr->cur, cur);
+	scr->cur = cur;
+}
+
+/**
+ * Bring the terminal up to date with the line, then put the cursor
+ * at the given position. With hl, the characters whose attributes have
+ * changed are redrawn too.
+ */
+static inline void
+cli_redraw(struct cli_output *out, struct cli_screen *scr, const struct cli_line *l, size_t cur,
+	   struct cli_highlight *hl)
+{
+	size_t len = cli_line_len(l), i, j;
+
+	if (scr->width > 0 && (len > scr->width || scr->len > scr->width || scr->off > 0)) {
+		cli_redraw_window(out, scr, l, cur, hl);
+		return;
+	}
+
+	switch (scr->op) {
+	case CLI_OP_INSERT:
+		cli_move_cursor(out, scr->cur, scr->op_pos);
+		if (scr->op_pos < scr->len) {
+			/* make room for the new characters */
+			cli_out_csi(out, scr->op_len, '@');
 		}
+		cli_redraw_write(out, hl, l, scr->op_pos, scr->op_pos + scr->op_len);
+		scr->cur = scr->op_pos + scr->op_len;
+		break;
+	case CLI_OP_DELETE:
+		cli_move_cursor(out, scr->cur, scr->op_pos);
+		/* shift the rest of the line to the left */
+		cli_out_csi(out, scr->op_len, 'P');
+		scr->cur = scr->op_pos;
+		break;
+	case CLI_OP_MIXED:
+		cli_move_cursor(out, scr->cur, scr->op_pos);
+		cli_redraw_write(out, hl, l, scr->op_pos, len);
+		if (scr->len > len) {
+			/* clear whatever is left of the previous line */
+			cli_out_str(out, "\033[K");
+		}
+		scr->cur = len;
+		break;
+	default:
+		break;
+	}
 
-		fprintf(f_out, "\xD%s > %s", str, buf);
-		if (off + pad > 0) {
-			/* move the cursor */
-			fprintf(f_out, "\033[%dD", off + pad);
+	/* the rest of the characters with new attributes */
+	for (i = hl ? hl->lo : 0; hl && i < hl->hi; i = j) {
+		if (hl->attr[i] == hl->shown[i]) {
+			j = i + 1;
+			continue;
 		}
-	} while (b != 0xD && len < blen);
+		for (j = i + 1; j < hl->hi && hl->attr[j] != hl->shown[j]; j++);
+		cli_move_cursor(out, scr->cur, i);
+		cli_highlight_write(out, hl, l, i, j);
+		scr->cur = j;
+	}
+
+	scr->op = CLI_OP_NONE;
+	scr->len = len;
+	cli_move_cursor(out, scr->cur, cur);
+	scr->cur = cur;
+}
+
+/* how much input is read from the terminal at once */
+#define CLI_INPUT_CHUNK 4096
+
+/**
+ * Input read in bulk from the terminal. Whatever is available is read in a
+ * single syscall and the whole chunk is processed before the line gets
+ * redrawn, so pasting text doesn't cost a read and a frame per byte.
+ * It also queues up any input following a complete line.
+ */
+struct cli_input {
+	unsigned char *buf;
+	size_t size; /* allocated size of buf */
+	size_t pos; /* next byte to be processed */
+	size_t len; /* number of valid bytes in buf */
+};
+
+/* make room for n more bytes at the end of the queue */
+static inline int
+cli_input_reserve(struct cli_input *in, size_t n)
+{
+	unsigned char *buf;
+	size_t size;
+
+	if (in->pos > 0) {
+		memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+		in->len -= in->pos;
+		in->pos = 0;
+	}
+
+	if (in->len + n <= in->size) {
+		return 0;
+	}
+
+	size = in->size ? in->size : CLI_INPUT_CHUNK;
+	while (size < in->len + n) {
+		size *= 2;
+	}
+
+	buf = (unsigned char *)realloc(in->buf, size);
+	if (buf == NULL) {
+		return -1;
+	}
+	in->buf = buf;
+	in->size = size;
+	return 0;
+}
 
-	if (b == 0xD) {
-		/* exclude the newline (or the padding) */
-		len--;
-		buf[len] = 0;
+/* queue input that couldn't be processed yet */
+static inline int
+cli_input_push(struct cli_input *in, const void *data, size_t n)
+{
+	if (n == 0) {
+		return 0;
+	}
+
+	if (cli_input_reserve(in, n) != 0) {
+		return -1;
+	}
+
+	memcpy(in->buf + in->len, data, n);
+	in->len += n;
+	return 0;
+}
+
+/**
+ * Read more input if all previous input was already processed.
+ * This blocks until at least one byte is available.
+ *
+ * \return 0 on success, -1 on EOF or a read error
+ */
+static inline int
+cli_input_fill(struct cli_input *in, int fd)
+{
+	ssize_t rc;
+
+	if (in->pos < in->len) {
+		return 0;
 	}
 
-	/* the following input won't be saved, but let's
-	 * not stop getting user input */
-	while (b != 0xD) {
-		b = getchar();
+	in->pos = in->len = 0;
+	if (cli_input_reserve(in, CLI_INPUT_CHUNK) != 0) {
+		return -1;
+	}
+
+	do {
+		rc = read(fd, in->buf, in->size);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc <= 0) {
+		return -1;
+	}
+
+	in->len = rc;
+	return 0;
+}
+
+/* telnet commands */
+#define CLI_TELNET_SE 240
+#define CLI_TELNET_IP 244 /* interrupt process */
+#define CLI_TELNET_SB 250
+#define CLI_TELNET_WILL 251
+#define CLI_TELNET_IAC 255
+#define CLI_TELNET_ECHO 1
+#define CLI_TELNET_SGA 3 /* suppress go ahead */
+
+/* values of cli_telnet.state */
+#define CLI_TELNET_DATA 0
+#define CLI_TELNET_CMD 1 /* after IAC */
+#define CLI_TELNET_OPT 2 /* after IAC WILL, WONT, DO or DONT */
+#define CLI_TELNET_SUB 3 /* inside IAC SB ... IAC SE */
+#define CLI_TELNET_SUB_IAC 4 /* after IAC inside IAC SB */
+#define CLI_TELNET_CR 5 /* after CR, which may be followed by NUL or LF */
+
+/* input filter for sessions on telnet connections */
+struct cli_telnet {
+	int enabled;
+	int state; /* CLI_TELNET_* */
+};
+
+/**
+ * Strip the telnet commands from the input, in place. End of line (CR NUL
+ * or CR LF) becomes just CR, like from a terminal in the raw mode.
+ *
+ * \return length of what's left
+ */
+static inline size_t
+cli_telnet_filter(struct cli_telnet *t, unsigned char *buf, size_t n)
+{
+	size_t i, len = 0;
+	unsigned char b;
+
+	for (i = 0; i < n; i++) {
+		b = buf[i];
+		switch (t->state) {
+		case CLI_TELNET_CR:
+			t->state = CLI_TELNET_DATA;
+			if (b == 0 || b == '\n') {
+				break;
+			}
+			/* fallthrough */
+		case CLI_TELNET_DATA:
+			if (b == CLI_TELNET_IAC) {
+				t->state = CLI_TELNET_CMD;
+			} else {
+				buf[len++] = b;
+				if (b == '\r') {
+					t->state = CLI_TELNET_CR;
+				}
+			}
+			break;
+		case CLI_TELNET_CMD:
+			if (b == CLI_TELNET_IAC) {
+				/* escaped 0xFF */
+				buf[len++] = b;
+				t->state = CLI_TELNET_DATA;
+			} else if (b == CLI_TELNET_IP) {
+				/* same as ctrl-c */
+				buf[len++] = 0x03;
+				t->state = CLI_TELNET_DATA;
+			} else if (b >= CLI_TELNET_WILL) {
+				t->state = CLI_TELNET_OPT;
+			} else if (b == CLI_TELNET_SB) {
+				t->state = CLI_TELNET_SUB;
+			} else {
+				t->state = CLI_TELNET_DATA;
+			}
+			break;
+		case CLI_TELNET_OPT:
+			/* the options are just ignored */
+			t->state = CLI_TELNET_DATA;
+			break;
+		case CLI_TELNET_SUB:
+			if (b == CLI_TELNET_IAC) {
+				t->state = CLI_TELNET_SUB_IAC;
+			}
+			break;
+		case CLI_TELNET_SUB_IAC:
+			t->state = b == CLI_TELNET_SE ? CLI_TELNET_DATA : CLI_TELNET_SUB;
+			break;
+		}
+	}
+
+	return len;
+}
+
+/* keys decoded from escape sequences, byte values are used for the rest */
+#define CLI_KEY_NONE 0x100 /* a sequence we don't know */
+#define CLI_KEY_UP 0x101
+#define CLI_KEY_DOWN 0x102
+#define CLI_KEY_RIGHT 0x103
+#define CLI_KEY_LEFT 0x104
+#define CLI_KEY_HOME 0x105
+#define CLI_KEY_END 0x106
+#define CLI_KEY_INSERT 0x107
+#define CLI_KEY_DELETE 0x108
+#define CLI_KEY_PAGE_UP 0x109
+#define CLI_KEY_PAGE_DOWN 0x10A
+#define CLI_KEY_PASTE_START 0x10B
+#define CLI_KEY_PASTE_END 0x10C
+#define CLI_KEY_COUNT (CLI_KEY_PASTE_END - CLI_KEY_NONE + 1)
+
+/* byte sent for ctrl+character, e.g. CLI_CTRL('a') */
+#define CLI_CTRL(c) ((c) & 0x1F)
+
+/* modifiers of the keys, as encoded by xterm */
+#define CLI_MOD_SHIFT 1
+#define CLI_MOD_ALT 2
+#define CLI_MOD_CTRL 4
+
+/* how long to wait for the rest of an escape sequence, after which it was
+ * just the escape key */
+#ifndef CLI_ESC_TIMEOUT_MS
+#define CLI_ESC_TIMEOUT_MS 100
+#endif
+
+/* values of cli_esc.state */
+#define CLI_ESC_NONE 0 /* not in an escape sequence */
+#define CLI_ESC_START 1 /* after ESC */
+#define CLI_ESC_CSI 2 /* after ESC [, in the parameters */
+#define CLI_ESC_SS3 3 /* after ESC O */
+
+/**
+ * Parser of the escape sequences sent by the terminal for special keys:
+ * ESC [ params final (CSI), ESC O final (SS3), or ESC followed by any
+ * other character for alt+character. It's fed one byte at a time and keeps
+ * only the numeric parameters, so sequences can be split anywhere.
+ */
+struct cli_esc {
+	int state; /* CLI_ESC_* */
+	unsigned params[2]; /* e.g. 3 and 5 in ESC [ 3 ; 5 ~ (ctrl+delete) */
+	size_t nparam; /* index of the parameter being received */
+	uint64_t start_ns; /* when the sequence began, for CLI_ESC_TIMEOUT_MS */
+	int key; /* the decoded CLI_KEY_* or character */
+	int mod; /* the decoded CLI_MOD_* */
+};
+
+/* byte classes of the escape sequence parser */
+#define CLI_EC_OTHER 0 /* control characters, DEL and anything non-ASCII */
+#define CLI_EC_ESC 1
+#define CLI_EC_CSI 2 /* [ */
+#define CLI_EC_SS3 3 /* O */
+#define CLI_EC_PARAM 4 /* 0x30-0x3F, digits and ; */
+#define CLI_EC_INTER 5 /* 0x20-0x2F, intermediate bytes */
+#define CLI_EC_FINAL 6 /* 0x40-0x7E */
+
+#define CLI_EC(c) \
+	((c) == 0x1b ? CLI_EC_ESC : (c) == '[' ? CLI_EC_CSI : (c) == 'O' ? CLI_EC_SS3 : \
+	 (c) >= 0x30 && (c) <= 0x3F ? CLI_EC_PARAM : (c) >= 0x20 && (c) <= 0x2F ? CLI_EC_INTER : \
+	 (c) >= 0x40 && (c) <= 0x7E ? CLI_EC_FINAL : CLI_EC_OTHER)
+#define CLI_EC4(c) CLI_EC(c), CLI_EC((c) + 1), CLI_EC((c) + 2), CLI_EC((c) + 3)
+#define CLI_EC16(c) CLI_EC4(c), CLI_EC4((c) + 4), CLI_EC4((c) + 8), CLI_EC4((c) + 12)
+
+static const unsigned char cli_esc_class[128] = {
+	CLI_EC16(0x00), CLI_EC16(0x10), CLI_EC16(0x20), CLI_EC16(0x30),
+	CLI_EC16(0x40), CLI_EC16(0x50), CLI_EC16(0x60), CLI_EC16(0x70),
+};
+
+/* actions of the escape sequence parser */
+#define CLI_EA_ABORT 0 /* not part of a sequence */
+#define CLI_EA_RESTART 1 /* a new sequence begins */
+#define CLI_EA_CSI 2
+#define CLI_EA_SS3 3
+#define CLI_EA_PARAM 4
+#define CLI_EA_SKIP 5 /* valid, but meaningless to us */
+#define CLI_EA_ALT 6 /* ESC followed by an ordinary character */
+#define CLI_EA_CSI_KEY 7 /* final byte of a CSI sequence */
+#define CLI_EA_SS3_KEY 8 /* final byte of an SS3 sequence */
+
+/* action for each state and byte class */
+static const unsigned char cli_esc_action[4][7] = {
+	/* OTHER, ESC, CSI, SS3, PARAM, INTER, FINAL */
+	{ CLI_EA_ABORT, CLI_EA_RESTART, CLI_EA_ABORT, CLI_EA_ABORT,
+	  CLI_EA_ABORT, CLI_EA_ABORT, CLI_EA_ABORT }, /* CLI_ESC_NONE */
+	{ CLI_EA_ABORT, CLI_EA_RESTART, CLI_EA_CSI, CLI_EA_SS3,
+	  CLI_EA_ALT, CLI_EA_ALT, CLI_EA_ALT }, /* CLI_ESC_START */
+	{ CLI_EA_ABORT, CLI_EA_RESTART, CLI_EA_CSI_KEY, CLI_EA_CSI_KEY,
+	  CLI_EA_PARAM, CLI_EA_SKIP, CLI_EA_CSI_KEY }, /* CLI_ESC_CSI */
+	{ CLI_EA_ABORT, CLI_EA_RESTART, CLI_EA_SS3_KEY, CLI_EA_SS3_KEY,
+	  CLI_EA_PARAM, CLI_EA_ABORT, CLI_EA_SS3_KEY }, /* CLI_ESC_SS3 */
+};
+
+/* keys for the final bytes A-Z of CSI and SS3 sequences */
+static const unsigned short cli_esc_letter[26] = {
+	CLI_KEY_UP, CLI_KEY_DOWN, CLI_KEY_RIGHT, CLI_KEY_LEFT, CLI_KEY_NONE,
+	CLI_KEY_END, CLI_KEY_NONE, CLI_KEY_HOME, CLI_KEY_NONE, CLI_KEY_NONE,
+	CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE,
+	CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE,
+	CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE, CLI_KEY_NONE,
+	CLI_KEY_NONE,
+};
+
+/* keys for ESC [ n ~ */
+static const unsigned short cli_esc_tilde[9] = {
+	CLI_KEY_NONE, CLI_KEY_HOME, CLI_KEY_INSERT, CLI_KEY_DELETE, CLI_KEY_END,
+	CLI_KEY_PAGE_UP, CLI_KEY_PAGE_DOWN, CLI_KEY_HOME, CLI_KEY_END,
+};
+
+/* values returned by cli_esc_feed() */
+#define CLI_ESC_MORE 0 /* the byte was consumed, the sequence continues */
+#define CLI_ESC_DONE 1 /* the sequence is complete, see cli_esc.key */
+#define CLI_ESC_NOT 2 /* the byte isn't part of the sequence */
+
+/* start parsing a sequence after receiving ESC */
+static inline void
+cli_esc_start(struct cli_esc *e)
+{
+	e->state = CLI_ESC_START;
+	e->params[0] = e->params[1] = 0;
+	e->nparam = 0;
+	e->start_ns = cli_now_ns();
+}
+
+/**
+ * Parse the next byte of an escape sequence.
+ *
+ * \return CLI_ESC_MORE, CLI_ESC_DONE, or CLI_ESC_NOT after which the byte
+ *         should be handled on its own
+ */
+static inline int
+cli_esc_feed(struct cli_esc *e, unsigned char b)
+{
+	int action = cli_esc_action[e->state][b < 0x80 ? cli_esc_class[b] : CLI_EC_OTHER];
+	unsigned *p;
+
+	switch (action) {
+	case CLI_EA_RESTART:
+		/* the previous ESC was on its own */
+		cli_esc_start(e);
+		return CLI_ESC_MORE;
+	case CLI_EA_CSI:
+		e->state = CLI_ESC_CSI;
+		return CLI_ESC_MORE;
+	case CLI_EA_SS3:
+		e->state = CLI_ESC_SS3;
+		return CLI_ESC_MORE;
+	case CLI_EA_PARAM:
+		p = &e->params[e->nparam];
+		if (b == ';') {
+			e->nparam = 1;
+		} else if (b >= '0' && b <= '9' && *p < 10000) {
+			*p = *p * 10 + b - '0';
+		}
+		return CLI_ESC_MORE;
+	case CLI_EA_SKIP:
+		return CLI_ESC_MORE;
+	case CLI_EA_ALT:
+		e->key = b;
+		e->mod = CLI_MOD_ALT;
+		break;
+	case CLI_EA_CSI_KEY:
+	case CLI_EA_SS3_KEY:
+		e->key = CLI_KEY_NONE;
+		if (b >= 'A' && b <= 'Z') {
+			e->key = cli_esc_letter[b - 'A'];
+		} else if (b == '~' && action == CLI_EA_CSI_KEY) {
+			if (e->params[0] < sizeof(cli_esc_tilde) / sizeof(cli_esc_tilde[0])) {
+				e->key = cli_esc_tilde[e->params[0]];
+			} else if (e->params[0] == 200) {
+				e->key = CLI_KEY_PASTE_START;
+			} else if (e->params[0] == 201) {
+				e->key = CLI_KEY_PASTE_END;
+			}
+		}
+		/* the modifier is the last parameter (plus one), either
+		 * ESC [ 1 ; 5 C or ESC O 5 C for ctrl+right */
+		p = &e->params[action == CLI_EA_SS3_KEY ? e->nparam : 1];
+		e->mod = *p > 1 ? (*p - 1) & 7 : 0;
+		break;
+	default:
+		e->state = CLI_ESC_NONE;
+		return CLI_ESC_NOT;
+	}
+
+	e->state = CLI_ESC_NONE;
+	return CLI_ESC_DONE;
+}
+
+/**
+ * Built-in history of the previous commands. The commands are stored
+ * one after another in a single arena buffer that is reused in a circular
+ * fashion, overwriting the oldest entries. Adding an entry or moving to the
+ * previous/next one is O(1) and nothing is allocated per entry.
+ *
+ * With deduplication, a hash index of the entries finds the previous copy
+ * of a repeated command. That copy is marked as removed and the command is
+ * added again as the newest. The removed entries are skipped while
+ * browsing, and they're squeezed out once there are too many of them.
+ *
+ * For the suggestions, a trie of the entries' prefixes remembers the newest
+ * entry with each prefix. The evicted entries are left in it and just
+ * ignored, until the trie is rebuilt once they make up most of it. It has
+ * at most a node per byte of the arena, which the prefixes of the entries
+ * in the arena can't exceed. If it still runs out, or can't be allocated,
+ * the entries are just scanned instead.
+ */
+struct cli_history_entry {
+	size_t off; /* offset of the command in the arena */
+	size_t len; /* 0 if the entry was removed */
+	uint64_t sig; /* see cli_history_sig() */
+};
+
+/* max length of the prefixes in the index. For a longer prefix, the entries
+ * that share its first CLI_TRIE_DEPTH characters are compared with it one
+ * by one, from the newest, so that's O(history size) at worst */
+#define CLI_TRIE_DEPTH 64
+
+/* initial number of the index nodes */
+#define CLI_TRIE_MIN 256
+
+/* a distinct prefix of the history entries */
+struct cli_trie_node {
+	uint32_t child; /* first longer prefix, 0 if none */
+	uint32_t next; /* next prefix of the same length, 0 if none */
+	uint32_t ent; /* slot in ents of the newest entry with this prefix */
+	unsigned char c; /* last character of the prefix */
+};
+
+struct cli_history {
+	struct cli_history_entry *ents; /* ring of entries, the oldest one is at first */
+	size_t max; /* size of ents */
+	size_t first;
+	size_t count;
+	char *arena;
+	size_t arena_size;
+	size_t head; /* arena offset for the next entry */
+	size_t pos; /* entry being browsed, count if none */
+	char *stash; /* the line that was being edited before browsing */
+	size_t stash_len;
+	size_t stash_size; /* allocated size of stash */
+	size_t *matches; /* entries found by cli_history_search(), newest first */
+	size_t nmatches;
+	int persist; /* whether new commands are appended to fd */
+	int fd; /* history file */
+	size_t *index; /* slot in ents + 1 for each hash, or 0, NULL without dedupe */
+	size_t index_mask; /* size of index - 1 */
+	size_t removed; /* number of removed entries */
+	struct cli_trie_node *trie; /* prefix index, NULL until it's needed */
+	size_t trie_nodes; /* used nodes, the first one is the empty prefix */
+	size_t trie_size; /* allocated nodes */
+	size_t trie_live; /* prefixes of the entries that weren't evicted yet */
+	size_t trie_max; /* max nodes, see cli_trie_build() */
+	int trie_failed; /* the trie isn't used anymore, until the history is reset */
+};
+
+/**
+ * Signature of a string used to quickly rule out history entries that don't
+ * contain it. Each character and each pair of consecutive characters sets
+ * one bit, so an entry can only contain the string if its signature has all
+ * of the string's bits set.
+ */
+static inline uint64_t
+cli_history_sig(const char *str, size_t len)
+{
+	uint64_t sig = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		sig |= 1ULL << (c & 63);
+		if (i > 0) {
+			sig |= 1ULL << (((unsigned char)str[i - 1] * 31 + c) & 63);
+		}
+	}
+
+	return sig;
+}
+
+/* memmem(), which is not standard */
+static inline int
+cli_contains(const char *str, size_t len, const char *needle, size_t nlen)
+{
+	const char *end;
+
+	if (nlen == 0 || nlen > len) {
+		return nlen == 0;
+	}
+
+	end = str + len - nlen;
+
+	for (; (str = (const char *)memchr(str, needle[0], end - str + 1)) != NULL; str++) {
+		if (memcmp(str, needle, nlen) == 0) {
+			return 1;
+		}
+		if (str == end) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static inline struct cli_history_entry *
+cli_history_at(struct cli_history *h, size_t i)
+{
+	return &h->ents[(h->first + i) % h->max];
+}
+
+static inline size_t
+cli_trie_depth(const struct cli_history_entry *e)
+{
+	return e->len < CLI_TRIE_DEPTH ? e->len : CLI_TRIE_DEPTH;
+}
+
+/* add the prefixes of the entry in the given slot to the index */
+static inline int
+cli_trie_add(struct cli_history *h, size_t slot)
+{
+	const struct cli_history_entry *e = &h->ents[slot];
+	const char *str = h->arena + e->off;
+	size_t depth = cli_trie_depth(e), i, size;
+	struct cli_trie_node *trie;
+	uint32_t node = 0, child;
+
+	for (i = 0; i < depth; i++) {
+		child = h->trie[node].child;
+		while (child != 0 && h->trie[child].c != (unsigned char)str[i]) {
+			child = h->trie[child].next;
+		}
+
+		if (child == 0) {
+			if (h->trie_nodes == h->trie_max) {
+				return -1;
+			} else if (h->trie_nodes == h->trie_size) {
+				size = 2 * h->trie_size < h->trie_max ? 2 * h->trie_size : h->trie_max;
+				trie = (struct cli_trie_node *)realloc(h->trie, size * sizeof(*trie));
+				if (trie == NULL) {
+					return -1;
+				}
+				h->trie = trie;
+				h->trie_size = size;
+			}
+			child = h->trie_nodes++;
+			h->trie[child].child = 0;
+			h->trie[child].next = h->trie[node].child;
+			h->trie[child].c = str[i];
+			h->trie[node].child = child;
+		}
+
+		h->trie[child].ent = slot;
+		node = child;
+	}
+
+	h->trie_live += depth;
+	return 0;
+}
+
+static inline void
+cli_trie_free(struct cli_history *h)
+{
+	free(h->trie);
+	h->trie = NULL;
+	h->trie_nodes = 0;
+	h->trie_size = 0;
+	h->trie_live = 0;
+}
+
+/**
+ * Build the prefix index from scratch. If it doesn't fit, it's not used
+ * anymore, instead of being built again on every key.
+ */
+static inline int
+cli_trie_build(struct cli_history *h)
+{
+	struct cli_history_entry *e;
+	size_t i;
+
+	if (h->trie_failed) {
+		return -1;
+	}
+
+	if (h->trie == NULL) {
+		h->trie = (struct cli_trie_node *)malloc(CLI_TRIE_MIN * sizeof(*h->trie));
+		if (h->trie == NULL) {
+			h->trie_failed = 1;
+			return -1;
+		}
+		h->trie_size = CLI_TRIE_MIN;
+		/* the live entries have fewer prefixes than bytes, and the
+		 * evicted ones are dropped once they run into it */
+		h->trie_max = h->arena_size + CLI_TRIE_MIN;
+	}
+
+	h->trie_nodes = 1;
+	h->trie_live = 0;
+	h->trie[0].child = 0;
+	for (i = 0; i < h->count; i++) {
+		e = cli_history_at(h, i);
+		if (e->len > 0 && cli_trie_add(h, e - h->ents) != 0) {
+			cli_trie_free(h);
+			h->trie_failed = 1;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Find the newest entry starting with the given prefix, in O(prefix length)
+ * unless it's longer than CLI_TRIE_DEPTH.
+ *
+ * \return the entry, or NULL if there's none, or it's not any longer than
+ *         the prefix
+ */
+static inline const struct cli_history_entry *
+cli_trie_find(struct cli_history *h, const char *prefix, size_t len)
+{
+	const struct cli_history_entry *e;
+	size_t depth = len < CLI_TRIE_DEPTH ? len : CLI_TRIE_DEPTH, i, slot;
+	uint32_t node = 0;
+
+	for (i = 0; i < depth; i++) {
+		node = h->trie[node].child;
+		while (node != 0 && h->trie[node].c != (unsigned char)prefix[i]) {
+			node = h->trie[node].next;
+		}
+		if (node == 0) {
+			return NULL;
+		}
+	}
+
+	if (node == 0) {
+		return NULL;
+	}
+
+	/* it may have been evicted since, and then so were the older ones */
+	slot = h->trie[node].ent;
+	i = (slot + h->max - h->first) % h->max;
+	if (i >= h->count) {
+		return NULL;
+	}
+
+	for (;; i--) {
+		e = cli_history_at(h, i);
+		if (e->len > len && memcmp(h->arena + e->off, prefix, len) == 0) {
+			return e;
+		}
+		if (len <= CLI_TRIE_DEPTH || i == 0) {
+			return NULL;
+		}
+		/* past the depth, an older entry may still match the rest */
+	}
+}
+
+/* find the newest entry longer than the prefix without the index, in O(history size) */
+static inline const struct cli_history_entry *
+cli_history_prefix(struct cli_history *h, const char *prefix, size_t len)
+{
+	const struct cli_history_entry *e;
+	size_t i;
+
+	for (i = h->count; i > 0; i--) {
+		e = cli_history_at(h, i - 1);
+		if (e->len > len && memcmp(h->arena + e->off, prefix, len) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static inline uint64_t
+cli_history_hash(const char *str, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)str[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* find the index position of the command, or the empty one where it'd go */
+static inline size_t
+cli_history_find(const struct cli_history *h, const char *line, size_t len)
+{
+	size_t i = cli_history_hash(line, len) & h->index_mask;
+	struct cli_history_entry *e;
+
+	while (h->index[i] != 0) {
+		e = &h->ents[h->index[i] - 1];
+		if (e->len == len && memcmp(h->arena + e->off, line, len) == 0) {
+			break;
+		}
+		i = (i + 1) & h->index_mask;
+	}
+
+	return i;
+}
+
+/* remove an entry from the index, shifting back the ones that follow it */
+static inline void
+cli_history_unindex(struct cli_history *h, struct cli_history_entry *e)
+{
+	size_t i = cli_history_find(h, h->arena + e->off, e->len), j = i, k;
+	struct cli_history_entry *next;
+
+	for (;;) {
+		j = (j + 1) & h->index_mask;
+		if (h->index[j] == 0) {
+			break;
+		}
+
+		/* move it to the hole, unless that's before its own hash */
+		next = &h->ents[h->index[j] - 1];
+		k = cli_history_hash(h->arena + next->off, next->len) & h->index_mask;
+		if (i <= j ? i < k && k <= j : i < k || k <= j) {
+			continue;
+		}
+		h->index[i] = h->index[j];
+		i = j;
+	}
+
+	h->index[i] = 0;
+}
+
+/* mark an entry as removed, it's dropped later by cli_history_squeeze() */
+static inline void
+cli_history_remove(struct cli_history *h, struct cli_history_entry *e)
+{
+	cli_history_unindex(h, e);
+	if (h->trie) {
+		h->trie_live -= cli_trie_depth(e);
+	}
+	e->len = 0;
+	e->sig = 0;
+	h->removed++;
+}
+
+/* rebuild the hash index from scratch */
+static inline void
+cli_history_reindex(struct cli_history *h)
+{
+	struct cli_history_entry *e;
+	size_t i;
+
+	memset(h->index, 0, (h->index_mask + 1) * sizeof(*h->index));
+	for (i = 0; i < h->count; i++) {
+		e = cli_history_at(h, i);
+		if (e->len > 0) {
+			h->index[cli_history_find(h, h->arena + e->off, e->len)] = e - h->ents + 1;
+		}
+	}
+}
+
+/* drop the removed entries, keeping the order of the rest */
+static inline void
+cli_history_squeeze(struct cli_history *h)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < h->count; i++) {
+		if (cli_history_at(h, i)->len > 0) {
+			*cli_history_at(h, n++) = *cli_history_at(h, i);
+		}
+	}
+
+	h->count = n;
+	h->removed = 0;
+	cli_history_reindex(h);
+	if (h->trie) {
+		/* the entries have moved */
+		cli_trie_build(h);
+	}
+}
+
+static inline void
+cli_history_evict(struct cli_history *h)
+{
+	struct cli_history_entry *e = cli_history_at(h, 0);
+
+	if (e->len == 0) {
+		h->removed--;
+	} else {
+		if (h->index) {
+			cli_history_unindex(h, e);
+		}
+		if (h->trie) {
+			h->trie_live -= cli_trie_depth(e);
+		}
+	}
+	h->first = (h->first + 1) % h->max;
+	h->count--;
+}
+
+/**
+ * Add a command to the history, removing the oldest ones if there's
+ * not enough space.
+ */
+static inline void
+cli_history_add(struct cli_history *h, const char *line, size_t len)
+{
+	struct cli_history_entry *e;
+	size_t i;
+
+	if (h->max == 0 || len == 0 || len > h->arena_size) {
+		return;
+	}
+
+	if (h->index) {
+		i = cli_history_find(h, line, len);
+		if (h->index[i] != 0) {
+			/* a repeated command, move it to the end instead */
+			cli_history_remove(h, &h->ents[h->index[i] - 1]);
+			if (h->removed > h->count / 2) {
+				cli_history_squeeze(h);
+			}
+		}
+	}
+
+	if (h->head + len > h->arena_size) {
+		/* the rest of the arena is too small, wrap around. Everything
+		 * past head is older than what's at the start of the arena */
+		while (h->count > 0 && cli_history_at(h, 0)->off >= h->head) {
+			cli_history_evict(h);
+		}
+		h->head = 0;
+	}
+
+	while (h->count > 0) {
+		e = cli_history_at(h, 0);
+		if (h->count < h->max && (e->off < h->head || e->off >= h->head + len)) {
+			break;
+		}
+		cli_history_evict(h);
+	}
+
+	e = cli_history_at(h, h->count++);
+	e->off = h->head;
+	e->len = len;
+	e->sig = cli_history_sig(line, len);
+	memcpy(h->arena + h->head, line, len);
+	h->head += len;
+	h->pos = h->count;
+
+	if (h->index) {
+		h->index[cli_history_find(h, line, len)] = e - h->ents + 1;
+	}
+
+	if (h->trie) {
+		if (h->trie_nodes > 2 * h->trie_live + CLI_TRIE_MIN) {
+			/* mostly the evicted entries, this one is added too */
+			cli_trie_build(h);
+		} else if (cli_trie_add(h, e - h->ents) != 0) {
+			/* full, unless the evicted entries are dropped */
+			cli_trie_build(h);
+		}
+	}
+}
+
+/* save the line being edited before replacing it with a history entry */
+static inline int
+cli_history_stash(struct cli_history *h, const struct cli_line *l)
+{
+	size_t len = cli_line_len(l);
+	char *stash;
+
+	if (h->pos != h->count) {
+		/* already saved */
+		return 0;
+	}
+
+	if (len + 1 > h->stash_size) {
+		stash = (char *)realloc(h->stash, len + 1);
+		if (stash == NULL) {
+			return -1;
+		}
+		h->stash = stash;
+		h->stash_size = len + 1;
+	}
+	cli_line_copy(l, h->stash);
+	h->stash_len = cli_line_len(l);
+	return 0;
+}
+
+/**
+ * Replace the line with the previous (dir == -1) or next (dir == 1) command.
+ * The line that was being edited is restored after moving past the newest
+ * command.
+ *
+ * \return 0 if the line was replaced, -1 if there's no such command
+ */
+static inline int
+cli_history_browse(struct cli_history *h, struct cli_line *l, int dir)
+{
+	struct cli_history_entry *e;
+	size_t pos = h->pos;
+
+	/* skip the removed entries */
+	do {
+		if (dir < 0 ? pos == 0 : pos >= h->count) {
+			return -1;
+		}
+		pos += dir;
+	} while (pos < h->count && cli_history_at(h, pos)->len == 0);
+
+	if (cli_history_stash(h, l) != 0) {
+		return -1;
+	}
+
+	h->pos = pos;
+	if (h->pos == h->count) {
+		cli_line_set(l, h->stash, h->stash_len);
+	} else {
+		e = cli_history_at(h, h->pos);
+		cli_line_set(l, h->arena + e->off, e->len);
+	}
+
+	return 0;
+}
+
+static inline void
+cli_history_free(struct cli_history *h)
+{
+	free(h->ents);
+	free(h->stash);
+	free(h->index);
+	free(h->trie);
+	if (h->persist) {
+		close(h->fd);
+	}
+	memset(h, 0, sizeof(*h));
+}
+
+/**
+ * Add the newest commands from the contents of a history file, one per
+ * line, as many as fit. The file is scanned backwards from its end, so
+ * only the commands that are kept are ever looked at, no matter how big
+ * the file is.
+ */
+static inline void
+cli_history_load(struct cli_history *h, const char *data, size_t size)
+{
+	size_t start = size, pos = size, end, n = 0, bytes = 0;
+
+	while (pos > 0 && n < h->max) {
+		end = data[pos - 1] == '\n' ? pos - 1 : pos;
+		pos = end;
+		while (pos > 0 && data[pos - 1] != '\n') {
+			pos--;
+		}
+
+		if (end == pos || end - pos > h->arena_size) {
+			/* it won't be added anyway */
+			continue;
+		} else if (bytes + end - pos > h->arena_size) {
+			break;
+		}
+		bytes += end - pos;
+		n++;
+		start = pos;
+	}
+
+	/* now forward, from the oldest */
+	for (pos = start; pos < size; pos = end + 1) {
+		const char *nl = (const char *)memchr(data + pos, '\n', size - pos);
+
+		end = nl ? (size_t)(nl - data) : size;
+		cli_history_add(h, data + pos, end - pos);
+	}
+}
+
+/* size of all commands in a history file, one per line */
+static inline size_t
+cli_history_bytes(struct cli_history *h)
+{
+	size_t i, total = 0;
+
+	for (i = 0; i < h->count; i++) {
+		if (cli_history_at(h, i)->len > 0) {
+			total += cli_history_at(h, i)->len + 1;
+		}
+	}
+	return total;
+}
+
+/* write all commands to a history file with a single write() */
+static inline int
+cli_history_save(struct cli_history *h, int fd)
+{
+	size_t i, total = cli_history_bytes(h), n = 0;
+	struct cli_history_entry *e;
+	ssize_t rc;
+	char *buf;
+
+	buf = (char *)malloc(total + 1);
+	if (buf == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < h->count; i++) {
+		e = cli_history_at(h, i);
+		if (e->len > 0) {
+			memcpy(buf + n, h->arena + e->off, e->len);
+			n += e->len;
+			buf[n++] = '\n';
+		}
+	}
+
+	rc = write(fd, buf, total);
+	free(buf);
+	return rc == (ssize_t)total ? 0 : -1;
+}
+
+/**
+ * Find all entries containing the query and put them in h->matches.
+ * With narrow set, the query must be an extension of the previous one, and
+ * only the previous matches are searched.
+ *
+ * \param from the match to start from, updated to the same or the next
+ *        older entry that still matches
+ */
+static inline void
+cli_history_search(struct cli_history *h, const char *query, size_t qlen,
+		   int narrow, size_t *from)
+{
+	uint64_t sig = cli_history_sig(query, qlen);
+	struct cli_history_entry *e;
+	size_t i, n = 0, cur = 0;
+
+	if (narrow) {
+		cur = SIZE_MAX;
+		for (i = 0; i < h->nmatches; i++) {
+			e = cli_history_at(h, h->matches[i]);
+			if (cli_contains(h->arena + e->off, e->len, query, qlen)) {
+				if (i >= *from && cur == SIZE_MAX) {
+					cur = n;
+				}
+				h->matches[n++] = h->matches[i];
+			}
+		}
+		if (cur == SIZE_MAX) {
+			cur = 0;
+		}
+	} else {
+		for (i = h->count; i > 0; i--) {
+			e = cli_history_at(h, i - 1);
+			if ((e->sig & sig) == sig &&
+			    cli_contains(h->arena + e->off, e->len, query, qlen)) {
+				h->matches[n++] = i - 1;
+			}
+		}
+	}
+
+	h->nmatches = n;
+	*from = cur;
+}
+
+/* max length of the ctrl-r search query */
+#define CLI_SEARCH_MAX 256
+
+/* state of the ctrl-r reverse incremental history search */
+struct cli_search {
+	int active;
+	char query[CLI_SEARCH_MAX];
+	size_t len;
+	size_t cur; /* index of the displayed entry in cli_history.matches */
+	int undo; /* cli_undo_add() mode for the line found by the search */
+};
+
+/* max number of remembered edits */
+#define CLI_UNDO_OPS 256
+
+/* size of their text, a power of 2 */
+#define CLI_UNDO_TEXT 8192
+
+/* the same for telnet sessions, whose lines are short, see CLI_LINE_MAX */
+#define CLI_UNDO_TELNET_OPS 64
+#define CLI_UNDO_TELNET_TEXT 1024
+
+/* values of the cli_undo_add() mode */
+#define CLI_UNDO_KEY 0 /* a key press, coalesced with the previous ones into words */
+#define CLI_UNDO_GROUP 1 /* the first of the edits undone together */
+#define CLI_UNDO_NEXT 2 /* the next edit of the group */
+
+/* insertion or deletion of some text */
+struct cli_undo_op {
+	size_t pos;
+	unsigned off; /* of the text in cli_undo.text, modulo cli_undo.text_size */
+	unsigned short len;
+	unsigned char insert;
+	unsigned char join; /* undone together with the previous op */
+};
+
+/**
+ * Log of the edits of the current line, for undo and redo. The edits are
+ * kept in a ring, and their text in another one, so it takes memory in
+ * proportion to the edits, and the oldest ones are forgotten once it's full.
+ * Nothing is allocated until the first edit.
+ */
+struct cli_undo {
+	struct cli_undo_op *ops; /* max_ops of them */
+	char *text; /* text_size bytes */
+	size_t max_ops; /* CLI_UNDO_OPS if 0 */
+	unsigned text_size; /* CLI_UNDO_TEXT if 0 */
+	size_t first; /* index of the oldest op */
+	size_t count;
+	size_t done; /* the ops after this many were undone */
+	unsigned head; /* where the text of the next op goes */
+	int open; /* the last op can be extended by the following key presses */
+};
+
+static inline struct cli_undo_op *
+cli_undo_op(struct cli_undo *u, size_t i)
+{
+	return &u->ops[(u->first + i) % u->max_ops];
+}
+
+/* forget all the edits */
+static inline void
+cli_undo_reset(struct cli_undo *u)
+{
+	u->first = 0;
+	u->count = 0;
+	u->done = 0;
+	u->open = 0;
+}
+
+/**
+ * Remember an edit of the line. Consecutive key presses are coalesced into
+ * words, so that they are undone together.
+ *
+ * \param u undo log
+ * \param insert whether the text was inserted or deleted
+ * \param pos position of the text in the line
+ * \param text the inserted or deleted text
+ * \param n its length
+ * \param mode CLI_UNDO_*
+ * \return 0 on success, -1 if it couldn't be remembered, and everything
+ *         else was forgotten
+ */
+static inline int
+cli_undo_add(struct cli_undo *u, int insert, size_t pos, const char *text, size_t n, int mode)
+{
+	struct cli_undo_op *op = NULL;
+	int merge = 0, join = mode == CLI_UNDO_NEXT;
+	size_t o, part;
+	char adj = ' ';
+
+	if (u->max_ops == 0) {
+		u->max_ops = CLI_UNDO_OPS;
+		u->text_size = CLI_UNDO_TEXT;
+	}
+
+	if (n == 0) {
+		return 0;
+	} else if (n > u->text_size) {
+		/* the older edits can't be undone without this one */
+		cli_undo_reset(u);
+		return -1;
+	}
+
+	if (u->ops == NULL) {
+		u->ops = (struct cli_undo_op *)malloc(u->max_ops * sizeof(*u->ops) + u->text_size);
+		if (u->ops == NULL) {
+			return -1;
+		}
+		u->text = (char *)(u->ops + u->max_ops);
+	}
+
+	if (u->done < u->count) {
+		/* the undone edits can't be redone anymore */
+		u->count = u->done;
+		u->open = 0;
+		if (u->count > 0) {
+			op = cli_undo_op(u, u->count - 1);
+			u->head = op->off + op->len;
+		}
+	}
+
+	op = u->count > 0 ? cli_undo_op(u, u->count - 1) : NULL;
+	if (op && op->insert == insert &&
+	    (mode == CLI_UNDO_NEXT || (mode == CLI_UNDO_KEY && u->open))) {
+		if (pos == op->pos + (insert ? op->len : 0)) {
+			/* typing, or deleting at the cursor, extends the last op */
+			adj = u->text[(op->off + op->len - 1) % u->text_size];
+			merge = 1;
+		} else if (!insert && pos + n == op->pos) {
+			/* backspace */
+			adj = u->text[op->off % u->text_size];
+			join = 1;
+		}
+		if (mode == CLI_UNDO_KEY && text[0] == ' ' && adj != ' ') {
+			/* a new word */
+			merge = join = 0;
+		}
+	}
+
+	/* make room by forgetting the oldest edits */
+	while (u->count > 0 && (u->head - cli_undo_op(u, 0)->off + n > u->text_size ||
+				(!merge && u->count == u->max_ops))) {
+		if (u->count == 1) {
+			merge = join = 0;
+		}
+		u->first = (u->first + 1) % u->max_ops;
+		u->count--;
+		if (u->count > 0) {
+			cli_undo_op(u, 0)->join = 0;
+		}
+	}
+
+	o = u->head % u->text_size;
+	part = u->text_size - o < n ? u->text_size - o : n;
+	memcpy(u->text + o, text, part);
+	memcpy(u->text, text + part, n - part);
+
+	if (merge) {
+		op->len += n;
+	} else {
+		op = cli_undo_op(u, u->count);
+		op->pos = pos;
+		op->off = u->head;
+		op->len = n;
+		op->insert = insert;
+		op->join = join && u->count > 0;
+		u->count++;
+	}
+
+	u->head += n;
+	u->done = u->count;
+	u->open = mode == CLI_UNDO_KEY;
+	return 0;
+}
+
+/* forget the last group of edits, when they didn't happen after all */
+static inline void
+cli_undo_pop(struct cli_undo *u)
+{
+	struct cli_undo_op *op;
+
+	while (u->count > 0) {
+		op = cli_undo_op(u, --u->count);
+		u->head = op->off;
+		if (!op->join) {
+			break;
+		}
+	}
+	u->done = u->count;
+	u->open = 0;
+}
+
+/* do the edit again (redo), or the opposite of it (undo) */
+static inline int
+cli_undo_apply(struct cli_undo *u, const struct cli_undo_op *op, struct cli_line *line,
+	       struct cli_screen *scr, int redo)
+{
+	size_t o = op->off % u->text_size;
+	size_t part = u->text_size - o < op->len ? u->text_size - o : op->len;
+
+	if (op->pos + (op->insert == redo ? 0 : op->len) > cli_line_len(line)) {
+		return -1;
+	}
+
+	cli_line_move(line, op->pos);
+	cli_screen_invalidate(scr, op->pos);
+	if (op->insert != redo) {
+		line->end += op->len;
+	} else if (cli_line_insert_n(line, u->text + o, part) != part ||
+		   cli_line_insert_n(line, u->text, op->len - part) != op->len - part) {
+		return -1;
+	}
+	return 0;
+}
+
+/* undo or redo the last group of edits */
+static inline void
+cli_undo_step(struct cli_undo *u, struct cli_line *line, struct cli_screen *scr, int redo)
+{
+	const struct cli_undo_op *op;
+	int rc = 0;
+
+	u->open = 0;
+	if (redo) {
+		while (rc == 0 && u->done < u->count) {
+			rc = cli_undo_apply(u, cli_undo_op(u, u->done++), line, scr, 1);
+			if (u->done < u->count && !cli_undo_op(u, u->done)->join) {
+				break;
+			}
+		}
+	} else {
+		while (rc == 0 && u->done > 0) {
+			op = cli_undo_op(u, --u->done);
+			rc = cli_undo_apply(u, op, line, scr, 0);
+			if (!op->join) {
+				break;
+			}
+		}
+	}
+
+	if (rc != 0) {
+		/* the line doesn't match the log, e.g. after cli_session_set_line_max() */
+		cli_undo_reset(u);
+	}
+}
+
+/* max size of the messages waiting to be shown */
+#define CLI_PRINT_MAX (1024 * 1024)
+
+/* default max rate of showing the messages, per second */
+#define CLI_PRINT_RATE 30
+
+/**
+ * Messages from other threads, waiting to be shown above the line being
+ * edited. Everything here but enabled and active is guarded by lock.
+ * The wake pipe is only created by the first message, so that the editor
+ * doesn't poll it on every key when nothing is ever printed.
+ */
+struct cli_print {
+	int enabled;
+	int active; /* whether the pipe exists, set once under lock */
+	pthread_mutex_t lock;
+	int wake[2]; /* pipe that wakes up the editor waiting for input */
+	int woken; /* whether there's something in the pipe already */
+	char *buf;
+	size_t len;
+	size_t size;
+	uint64_t last_ns; /* when the messages were shown last time */
+	uint64_t interval_ns; /* min time between showing them */
+};
+
+static inline void
+cli_print_init(struct cli_print *p)
+{
+	pthread_mutex_init(&p->lock, NULL);
+	p->wake[0] = p->wake[1] = -1;
+	p->interval_ns = 1000000000ULL / CLI_PRINT_RATE;
+	p->enabled = 1;
+}
+
+/* whether cli_session_print() was used already, from any thread */
+static inline int
+cli_print_active(const struct cli_print *p)
+{
+	return p->enabled && __atomic_load_n(&p->active, __ATOMIC_ACQUIRE);
+}
+
+/* create the wake pipe, unless it exists already; called under lock */
+static inline int
+cli_print_start(struct cli_print *p)
+{
+	int i;
+
+	if (p->active) {
+		return 0;
+	}
+
+	if (pipe(p->wake) != 0) {
+		p->wake[0] = p->wake[1] = -1;
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fcntl(p->wake[i], F_SETFL, O_NONBLOCK);
+		fcntl(p->wake[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	__atomic_store_n(&p->active, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* empty the wake pipe; called under lock */
+static inline void
+cli_print_unwake(struct cli_print *p)
+{
+	char c;
+
+	if (p->woken) {
+		while (read(p->wake[0], &c, 1) > 0);
+		p->woken = 0;
+	}
+}
+
+static inline void
+cli_print_free(struct cli_print *p)
+{
+	if (!p->enabled) {
+		return;
+	}
+
+	pthread_mutex_destroy(&p->lock);
+	if (p->active) {
+		close(p->wake[0]);
+		close(p->wake[1]);
+	}
+	free(p->buf);
+	memset(p, 0, sizeof(*p));
+}
+
+/* return values of cli_feed() */
+enum cli_status {
+	CLI_TIMEOUT = -2, /* nothing came in time, see cli_session_set_timeout() */
+	CLI_EOF = -1, /* end of input, no more lines */
+	CLI_NEED_MORE = 0, /* the line is not complete yet */
+	CLI_LINE_READY = 1, /* the line is complete */
+};
+
+/* size of the line passed to history_cb when the line length is unlimited,
+ * and the default line length limit of telnet sessions */
+#define CLI_LINE_MAX 1023
+
+struct cli_session;
+
+/**
+ * Function bound to a key with cli_bind_key().
+ *
+ * \param s session
+ * \param key the byte, CLI_KEY_*, or the character pressed with alt
+ * \return CLI_NEED_MORE to continue editing the line, CLI_LINE_READY to
+ *         finish it, or CLI_EOF
+ */
+typedef int (*cli_action)(struct cli_session *s, int key);
+
+/**
+ * Actions for all the keys, so each key press is just a lookup. NULL
+ * entries are ignored.
+ */
+struct cli_keymap {
+	cli_action byte[256];
+#if CLI_GETS_ESCAPES
+	cli_action key[CLI_KEY_COUNT][8]; /* CLI_KEY_* for each CLI_MOD_* combination */
+	cli_action alt[128]; /* alt+character */
+#endif
+	int bind_text; /* some printable characters don't just insert themselves */
+};
+
+/**
+ * Called when tab is pressed, to find the completions of the word before
+ * the cursor. The callback passes them to cli_session_complete(), either
+ * right away, or later, e.g. once they arrive from the network. The user
+ * can keep typing in the meantime, and the late completions are dropped
+ * if the line has changed.
+ *
+ * \param s session
+ * \param line the whole line, null-terminated, valid until the callback
+ *        returns
+ * \param len length of the line
+ * \param cursor cursor position
+ * \param arg argument given to cli_session_set_completion()
+ */
+typedef void (*cli_complete_cb)(struct cli_session *s, const char *line, size_t len,
+				size_t cursor, void *arg);
+
+/* state of the tab completion */
+struct cli_complete {
+	cli_complete_cb cb;
+	void *arg;
+	int pending; /* waiting for cli_session_complete() */
+	int in_cb; /* cli_session_complete() is called from the callback */
+	size_t pos; /* cursor position when tab was pressed */
+	size_t len; /* and length of the line */
+	uint64_t hash; /* and its hash, to tell if it has changed since */
+	char *cands; /* candidates of the displayed list, one after another */
+	size_t size; /* allocated size of cands */
+	size_t n; /* number of the candidates */
+	size_t shown; /* how many were displayed already */
+	size_t width; /* length of the longest one */
+};
+
+/**
+ * A line editor attached to the terminal. It keeps the terminal in the raw
+ * mode for its whole lifetime and keeps any input following the line that
+ * was just read, so reading many lines in a row doesn't toggle the terminal
+ * mode or lose any typed-ahead input.
+ */
+struct cli_session {
+	FILE *f_out; /* flushed before anything is written to out.fd */
+	const char *prompt;
+	cli_history_cb history_cb;
+	int fd; /* input terminal */
+	struct cli_output out;
+	int raw; /* whether the terminal was switched to the raw mode */
+	int plain; /* the input isn't a terminal, just read the lines as they are */
+	struct termios oldt; /* terminal configuration to restore */
+	struct cli_input in;
+	struct cli_screen scr;
+	struct cli_line line;
+	struct cli_history hist;
+	struct cli_search search;
+	struct cli_undo undo;
+	int state; /* CLI_STATE_* */
+	size_t line_max; /* max line length for cli_feed() and cli_session_readline() */
+	struct cli_esc esc; /* escape sequence being received */
+	int pasting; /* inside a bracketed paste */
+	size_t paste_match; /* length of the partially received end marker */
+	size_t dropped; /* input bytes that didn't fit in the current line */
+	char *cb_buf; /* line passed to history_cb */
+	size_t cb_size;
+	struct cli_print print;
+	struct cli_telnet telnet;
+	struct cli_keymap *keys; /* NULL for the default one */
+	struct cli_highlight hl;
+	int suggest; /* whether to show the suggestions */
+	const char *sugg; /* the rest of the suggested line */
+	size_t sugg_len;
+	struct cli_complete comp;
+	unsigned deadline_ms; /* max time of a blocking read, 0 for none */
+	unsigned idle_ms; /* max time between keys of a blocking read, 0 for none */
+	int timed_out; /* the last blocking read ended with CLI_TIMEOUT */
+	size_t cols, rows; /* size of the terminal, 0 if unknown */
+	sig_atomic_t winch; /* cli_winch when the size was checked */
+#if CLI_GETS_STATS
+	struct cli_stats *stats;
+#endif
+};
+
+/* session whose terminal needs to be restored at exit */
+static struct cli_session *volatile cli_tty_owner;
+
+/* number of SIGWINCHs, i.e. terminal size changes */
+static volatile sig_atomic_t cli_winch;
+
+/* this is async-signal-safe */
+static void
+cli_tty_atexit(void)
+{
+	struct cli_session *s = cli_tty_owner;
+
+	if (s != NULL) {
+		tcsetattr(s->fd, TCSANOW, &s->oldt);
+		if (CLI_GETS_ESCAPES && write(s->out.fd, "\033[?2004l", 8) < 0) {
+			/* nothing to do */
+		}
+	}
+}
+
+static void
+cli_tty_signal(int sig)
+{
+	cli_tty_atexit();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void
+cli_tty_winch(int sig)
+{
+	(void)sig;
+	cli_winch = cli_winch + 1;
+}
+
+/**
+ * Make sure the terminal is restored on exit() and on any signal that would
+ * terminate the process with the terminal still in the raw mode. Signals
+ * already handled by the application are left alone.
+ */
+static inline void
+cli_tty_register_cleanup(void)
+{
+	static const int signals[] = { SIGHUP, SIGTERM, SIGQUIT, SIGPIPE };
+	static int registered;
+	struct sigaction sa;
+	size_t i;
+
+	if (registered) {
+		return;
+	}
+	registered = 1;
+
+	atexit(cli_tty_atexit);
+	for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+		if (sigaction(signals[i], NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+			sa.sa_handler = cli_tty_signal;
+			/* the application's own syscalls must not fail with EINTR */
+			sa.sa_flags |= SA_RESTART;
+			sigaction(signals[i], &sa, NULL);
+		}
+	}
+
+	/* the terminal size is cached until it changes */
+	if (sigaction(SIGWINCH, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+		sa.sa_handler = cli_tty_winch;
+		sa.sa_flags |= SA_RESTART;
+		sigaction(SIGWINCH, &sa, NULL);
+	}
+}
+
+/* send the frame to the terminal */
+static inline void
+cli_session_flush(struct cli_session *s)
+{
+	unsigned writes;
+	size_t len;
+
+	if (s->out.len == 0) {
+		return;
+	}
+
+	if (s->f_out != NULL) {
+		/* anything printed by the application goes first */
+		fflush(s->f_out);
+	}
+	len = s->out.len;
+	writes = cli_out_flush(&s->out);
+	CLI_STAT_ADD(s, bytes_written, len - s->out.len);
+	CLI_STAT_ADD(s, writes, writes);
+}
+
+/* size of the terminal, 0x0 if it's unknown */
+static inline void
+cli_term_size(int fd, size_t *cols, size_t *rows)
+{
+	struct winsize ws;
+
+	*cols = 0;
+	*rows = 0;
+	if (ioctl(fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+		*cols = ws.ws_col;
+		*rows = ws.ws_row;
+	}
+}
+
+/* check the terminal size again, after it was changed */
+static inline void
+cli_session_winsize(struct cli_session *s)
+{
+	s->winch = cli_winch;
+	cli_term_size(s->out.fd, &s->cols, &s->rows);
+}
+
+static inline void
+cli_tty_raw(struct cli_session *s)
+{
+	struct termios newt;
+
+	/* to detect arrow key presses etc. we'll switch the current user terminal
+	 * to the "raw" mode where all special processing of input characters is
+	 * disabled. Before we do that, let's save the previous configuration so
+	 * we'll be able to restore it later */
+	if (s->raw || s->plain || tcgetattr(s->fd, &s->oldt) != 0) {
+		return;
+	}
+
+	cli_tty_register_cleanup();
+	cli_tty_owner = s;
+	s->raw = 1;
+
+	newt = s->oldt;
+	cfmakeraw(&newt);
+	tcsetattr(s->fd, TCSANOW, &newt);
+	cli_session_winsize(s);
+
+	/* let pasted text be told apart from typed keys */
+	if (CLI_GETS_ESCAPES) {
+		cli_out_str(&s->out, "\033[?2004h");
+		cli_session_flush(s);
+	}
+}
+
+static inline void
+cli_tty_restore(struct cli_session *s)
+{
+	if (!s->raw) {
+		return;
+	}
+
+	if (CLI_GETS_ESCAPES) {
+		cli_out_str(&s->out, "\033[?2004l");
+	}
+	cli_session_flush(s);
+	tcsetattr(s->fd, TCSANOW, &s->oldt);
+	s->raw = 0;
+	if (cli_tty_owner == s) {
+		cli_tty_owner = NULL;
+	}
+}
+
+/**
+ * Start reading lines from the terminal.
+ *
+ * \param s session to initialize
+ * \param fd_in terminal to read the user input from
+ * \param fd_out terminal for printing the user input
+ * \param prompt Any custom string to print before the command prompt.
+ *        Must be null-terminated and valid until the session is closed.
+ * \param history_cb function to retrieve previous/next user command whenever the
+ *        up or down key is pressed. This callback is optional, can be NULL. Then
+ *        up/down keys simply won't do anything.
+ * \return 0 on success
+ */
+static inline int
+cli_session_open_fd(struct cli_session *s, int fd_in, int fd_out, const char *prompt,
+		    cli_history_cb history_cb)
+{
+	memset(s, 0, sizeof(*s));
+	s->prompt = prompt;
+	s->history_cb = history_cb;
+	s->fd = fd_in;
+	s->out.fd = fd_out;
+	s->line_max = CLI_LINE_UNLIMITED;
+	s->plain = !isatty(fd_in);
+	cli_print_init(&s->print);
+
+	cli_tty_raw(s);
+	return 0;
+}
+
+/**
+ * Start reading lines from STDIN_FILENO.
+ *
+ * \param s session to initialize
+ * \param f_out FILE for printing the user input. Usually stdout or stderr.
+ *        It's written to directly with write(), but it's always flushed first.
+ * \param prompt Any custom string to print before the command prompt.
+ *        Must be null-terminated and valid until the session is closed.
+ * \param history_cb function to retrieve previous/next user command whenever the
+ *        up or down key is pressed. This callback is optional, can be NULL. Then
+ *        up/down keys simply won't do anything.
+ * \return 0 on success
+ */
+static inline int
+cli_session_open(struct cli_session *s, FILE *f_out, const char *prompt,
+		 cli_history_cb history_cb)
+{
+	int rc;
+
+	rc = cli_session_open_fd(s, STDIN_FILENO, fileno(f_out), prompt, history_cb);
+	s->f_out = f_out;
+	return rc;
+}
+
+/**
+ * Start a session on a telnet connection, e.g. an accepted TCP socket.
+ * The terminal is on the other end, so instead of switching it to the raw
+ * mode, the client is asked to send each key right away and to leave the
+ * echo to the editor. Telnet commands are stripped from the input.
+ *
+ * The memory per session is bounded. The lines are limited to CLI_LINE_MAX
+ * characters by default, and the undo log is smaller than on a terminal,
+ * so an active session takes about 9 KB: the input and output buffers,
+ * the line, and the undo log from the first edit. A client that doesn't
+ * read its output can make it up to about 48 KB, and once it leaves more
+ * than CLI_OUTPUT_BACKLOG_MAX unread, the session ends. Only the
+ * negotiation is sent, and allocated, when the session is opened.
+ * cli_session_print() isn't available for these sessions. Ctrl-c, ctrl-z
+ * and telnet's Interrupt Process end the session like EOF, instead of the
+ * whole process.
+ *
+ * The session can be read from with cli_session_gets(), or, together with
+ * many others, with cli_feed() or struct cli_server. Only the former waits
+ * for the client to take the output, see cli_session_send().
+ *
+ * \param s session to initialize
+ * \param fd connected socket
+ * \param prompt Any custom string to print before the command prompt.
+ *        Must be null-terminated and valid until the session is closed.
+ * \param history_cb see cli_session_open()
+ * \return 0 on success
+ */
+static inline int
+cli_session_open_telnet(struct cli_session *s, int fd, const char *prompt,
+			cli_history_cb history_cb)
+{
+	static const unsigned char negotiate[] = {
+		CLI_TELNET_IAC, CLI_TELNET_WILL, CLI_TELNET_ECHO,
+		CLI_TELNET_IAC, CLI_TELNET_WILL, CLI_TELNET_SGA,
+	};
+
+	memset(s, 0, sizeof(*s));
+	s->prompt = prompt;
+	s->history_cb = history_cb;
+	s->fd = fd;
+	s->out.fd = fd;
+	s->out.sock = 1;
+	s->line_max = CLI_LINE_MAX;
+	s->telnet.enabled = 1;
+	s->undo.max_ops = CLI_UNDO_TELNET_OPS;
+	s->undo.text_size = CLI_UNDO_TELNET_TEXT;
+
+	cli_out_write(&s->out, negotiate, sizeof(negotiate));
+	s->out.telnet = 1;
+	if (CLI_GETS_ESCAPES) {
+		cli_out_str(&s->out, "\033[?2004h");
+	}
+	cli_session_flush(s);
+	return 0;
+}
+
+/**
+ * Restore the terminal. Any input following the last read line is discarded.
+ */
+static inline void
+cli_session_close(struct cli_session *s)
+{
+	cli_tty_restore(s);
+	free(s->in.buf);
+	free(s->out.buf);
+	free(s->line.buf);
+	free(s->cb_buf);
+	memset(&s->in, 0, sizeof(s->in));
+	s->out.buf = NULL;
+	s->out.size = 0;
+	memset(&s->line, 0, sizeof(s->line));
+	s->cb_buf = NULL;
+	s->cb_size = 0;
+	cli_history_free(&s->hist);
+	cli_print_free(&s->print);
+	free(s->keys);
+	s->keys = NULL;
+	free(s->undo.ops);
+	memset(&s->undo, 0, sizeof(s->undo));
+	free(s->hl.attr);
+	free(s->hl.shown);
+	memset(&s->hl, 0, sizeof(s->hl));
+	free(s->comp.cands);
+	memset(&s->comp, 0, sizeof(s->comp));
+}
+
+/**
+ * Enable the built-in history. It's used for the up and down arrow keys
+ * whenever the session has no history_cb. Each non-empty line read by
+ * cli_session_gets() or cli_feed() is added to it. Calling this again discards any
+ * previous history.
+ *
+ * \param s session
+ * \param max_entries max number of remembered commands, 0 to disable the history
+ * \param arena_size memory for storing the commands, in bytes
+ * \return 0 on success, -1 if the memory couldn't be allocated
+ */
+static inline int
+cli_session_set_history(struct cli_session *s, size_t max_entries, size_t arena_size)
+{
+	struct cli_history *h = &s->hist;
+	char *mem = NULL;
+
+	if (!CLI_GETS_HISTORY) {
+		return -1;
+	}
+
+	if (max_entries > 0) {
+		mem = (char *)malloc(max_entries * (sizeof(*h->ents) + sizeof(*h->matches)) +
+				     arena_size);
+		if (mem == NULL) {
+			return -1;
+		}
+	}
+
+	cli_history_free(h);
+	h->ents = (struct cli_history_entry *)mem;
+	h->max = max_entries;
+	h->matches = (size_t *)(h->ents + max_entries);
+	h->arena = mem ? (char *)(h->matches + max_entries) : NULL;
+	h->arena_size = arena_size;
+	return 0;
+}
+
+/**
+ * Keep just the newest copy of each command in the built-in history.
+ * Repeating a command moves it to the front instead of storing it again,
+ * in O(1) with a hash index of the commands. Any duplicates already in the
+ * history are dropped.
+ *
+ * Call this after cli_session_set_history(), and before
+ * cli_session_history_file() so the loaded commands are deduplicated too.
+ *
+ * \param s session
+ * \return 0 on success, -1 if the history is disabled or the memory couldn't
+ *         be allocated
+ */
+static inline int
+cli_session_dedupe_history(struct cli_session *s)
+{
+	struct cli_history *h = &s->hist;
+	struct cli_history_entry *e;
+	size_t i, pos, size = 1;
+
+	if (!CLI_GETS_HISTORY || h->max == 0) {
+		return -1;
+	} else if (h->index) {
+		return 0;
+	}
+
+	/* keep it at most half full */
+	while (size < 2 * h->max) {
+		size *= 2;
+	}
+	h->index = (size_t *)calloc(size, sizeof(*h->index));
+	if (h->index == NULL) {
+		return -1;
+	}
+	h->index_mask = size - 1;
+
+	for (i = 0; i < h->count; i++) {
+		e = cli_history_at(h, i);
+		pos = cli_history_find(h, h->arena + e->off, e->len);
+		if (h->index[pos] != 0) {
+			cli_history_remove(h, &h->ents[h->index[pos] - 1]);
+			pos = cli_history_find(h, h->arena + e->off, e->len);
+		}
+		h->index[pos] = e - h->ents + 1;
+	}
+
+	cli_history_squeeze(h);
+	h->pos = h->count;
+	return 0;
+}
+
+/**
+ * Keep the built-in history in a file, so it survives between runs. The
+ * newest commands from the file are loaded into the history right away,
+ * and each new command is appended to the file with a single write().
+ * Loading takes the same time no matter how big the file has grown.
+ * Once most of the file is made of commands too old to be loaded anymore
+ * (or of duplicates, see cli_session_dedupe_history()), it's rewritten
+ * with just the loaded ones.
+ *
+ * Enable the history with cli_session_set_history() first. Calling that
+ * again stops using the file.
+ *
+ * \param s session
+ * \param path history file, created if it doesn't exist
+ * \return 0 on success, -1 if the file couldn't be opened, read, or written
+ */
+static inline int
+cli_session_history_file(struct cli_session *s, const char *path)
+{
+	struct cli_history *h = &s->hist;
+	struct stat st;
+	size_t size;
+	char *data, *tmp;
+	int fd, tmp_fd, unterminated = 0;
+
+	if (!CLI_GETS_HISTORY || h->max == 0) {
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return -1;
+	} else if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	size = st.st_size;
+	if (size > 0) {
+		data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+
+		cli_history_load(h, data, size);
+		/* e.g. edited by hand, or cut short by a crash */
+		unterminated = data[size - 1] != '\n';
+		munmap(data, size);
+
+		if (size > 2 * cli_history_bytes(h)) {
+			/* compact it, replacing the file with just the loaded
+			 * commands */
+			tmp = (char *)malloc(strlen(path) + sizeof(".tmp"));
+			tmp_fd = -1;
+			if (tmp != NULL) {
+				strcpy(tmp, path);
+				strcat(tmp, ".tmp");
+				tmp_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+					      0600);
+			}
+			if (tmp_fd >= 0 && fchmod(tmp_fd, st.st_mode & 07777) == 0 &&
+			    cli_history_save(h, tmp_fd) == 0 && rename(tmp, path) == 0) {
+				close(fd);
+				fd = tmp_fd;
+				unterminated = 0;
+			} else if (tmp_fd >= 0) {
+				close(tmp_fd);
+				unlink(tmp);
+			}
+			free(tmp);
+		}
+	}
+
+	if (unterminated && write(fd, "\n", 1) != 1) {
+		/* the new commands would be appended to its last line */
+		close(fd);
+		return -1;
+	}
+
+	if (h->persist) {
+		close(h->fd);
+	}
+	h->fd = fd;
+	h->persist = 1;
+	return 0;
+}
+
+/**
+ * Highlight the syntax of the line as it's being edited. The callback is
+ * asked only about the changed part of the line, and only the characters
+ * whose attributes have changed are redrawn.
+ *
+ * \param s session
+ * \param cb callback returning the attributes, NULL to disable highlighting
+ * \param palette SGR parameters for the attributes 1 to npalette - 1, e.g.
+ *        "1;34" for bold blue. Entry 0 is unused, it's the default look.
+ *        Must be valid until the session is closed.
+ * \param npalette number of entries in palette
+ * \param arg passed to cb
+ */
+static inline void
+cli_session_set_highlight(struct cli_session *s, cli_highlight_cb cb, const char *const *palette,
+			  size_t npalette, void *arg)
+{
+	s->hl.cb = cb;
+	s->hl.arg = arg;
+	s->hl.palette = palette;
+	s->hl.npalette = npalette;
+	s->scr.prompt_dirty = 1;
+}
+
+/**
+ * Suggest the rest of the line while it's being typed, from the newest
+ * command in the built-in history that starts with it. The suggestion is
+ * shown dimmed after the cursor, and the right arrow at the end of the line
+ * accepts it. It's found in a prefix index of the history, built on first
+ * use, so it costs O(length of the line) per key press. If the index can't
+ * be allocated, the history is scanned instead, in O(history size).
+ *
+ * \param s session
+ * \param enable 1 to show the suggestions, 0 to stop
+ */
+static inline void
+cli_session_set_suggest(struct cli_session *s, int enable)
+{
+	s->suggest = enable;
+	if (!enable) {
+		cli_trie_free(&s->hist);
+	}
+}
+
+/**
+ * Limit the length of lines read by cli_feed() and cli_session_readline().
+ * The rest of a longer line is discarded.
+ *
+ * \param s session
+ * \param max max number of characters, CLI_LINE_UNLIMITED by default
+ */
+static inline void
+cli_session_set_line_max(struct cli_session *s, size_t max)
+{
+	s->line_max = max;
+}
+
+/**
+ * Give up waiting for the line in cli_session_gets() and
+ * cli_session_readline() after some time. The line being edited is then
+ * discarded, the terminal mode is restored, and CLI_TIMEOUT is returned.
+ * The raw mode is set again with the next call.
+ *
+ * Event loops using cli_feed() keep track of the time on their own.
+ *
+ * \param s session
+ * \param deadline_ms max time of each call, 0 for none
+ * \param idle_ms max time to wait for the next key, 0 for none
+ */
+static inline void
+cli_session_set_timeout(struct cli_session *s, unsigned deadline_ms, unsigned idle_ms)
+{
+	s->deadline_ms = deadline_ms;
+	s->idle_ms = idle_ms;
+}
+
+/**
+ * Start counting what the session is doing. The counters are added to,
+ * so they should be zeroed first. Does nothing if CLI_GETS_STATS is 0.
+ *
+ * \param s session
+ * \param stats counters to update, NULL to stop counting
+ */
+static inline void
+cli_session_set_stats(struct cli_session *s, struct cli_stats *stats)
+{
+#if CLI_GETS_STATS
+	s->stats = stats;
+#else
+	(void)s;
+	(void)stats;
+#endif
+}
+
+/**
+ * Add a command to the built-in history, e.g. one that was saved by
+ * the application earlier, or one that wasn't typed in by the user.
+ */
+static inline void
+cli_session_add_history(struct cli_session *s, const char *line, size_t len)
+{
+	if (CLI_GETS_HISTORY) {
+		cli_history_add(&s->hist, line, len);
+	}
+}
+
+static inline void
+cli_draw_prompt(struct cli_session *s)
+{
+	struct cli_search *q = &s->search;
+	size_t start = s->out.len + 1, plen;
+
+	if (q->active) {
+		cli_out_str(&s->out, "\xD(");
+		if (q->len > 0 && s->hist.nmatches == 0) {
+			cli_out_str(&s->out, "failed ");
+		}
+		cli_out_str(&s->out, "reverse-i-search)`");
+		cli_out_write(&s->out, q->query, q->len);
+		cli_out_str(&s->out, "': ");
+	} else {
+		cli_out_str(&s->out, "\xD");
+		cli_out_str(&s->out, s->prompt);
+		cli_out_str(&s->out, " > ");
+	}
+
+	/* the line will be drawn from scratch */
+	plen = s->out.len - start;
+	cli_out_str(&s->out, "\033[K");
+	memset(&s->scr, 0, sizeof(s->scr));
+	cli_screen_invalidate(&s->scr, 0);
+
+	if (s->cols > 0) {
+		/* the last column is left for the cursor */
+		s->scr.width = s->cols > plen + 2 ? s->cols - plen - 1 : 1;
+	}
+}
+
+/**
+ * Update the attributes of the line after it was edited as described by
+ * the screen op, and ask the callback about the changed part.
+ *
+ * \return 0 on success, -1 if the memory couldn't be allocated
+ */
+static inline int
+cli_highlight(struct cli_session *s)
+{
+	struct cli_highlight *hl = &s->hl;
+	struct cli_screen *scr = &s->scr;
+	struct cli_line *line = &s->line;
+	struct cli_span spans[CLI_HIGHLIGHT_SPANS];
+	size_t len = cli_line_len(line), old = scr->len, gap = line->gap;
+	size_t from = scr->op_pos, to = len, n, i, end;
+	unsigned char *buf;
+
+	hl->lo = hl->hi = 0;
+	if (scr->op == CLI_OP_NONE || (len == 0 && old == 0)) {
+		return 0;
+	}
+
+	if (len > hl->size || old > hl->size) {
+		n = len > old ? len : old;
+		buf = (unsigned char *)realloc(hl->attr, n);
+		if (buf == NULL) {
+			return -1;
+		}
+		hl->attr = buf;
+		buf = (unsigned char *)realloc(hl->shown, n);
+		if (buf == NULL) {
+			return -1;
+		}
+		hl->shown = buf;
+		hl->size = n;
+	}
+
+	/* follow what the terminal does with the characters after the change */
+	if (scr->op == CLI_OP_INSERT) {
+		to = from + scr->op_len;
+		memmove(hl->attr + to, hl->attr + from, old - from);
+		memmove(hl->shown + to, hl->shown + from, old - from);
+	} else if (scr->op == CLI_OP_DELETE) {
+		to = from;
+		memmove(hl->attr + from, hl->attr + from + scr->op_len, len - from);
+		memmove(hl->shown + from, hl->shown + from + scr->op_len, len - from);
+	}
+	memset(hl->attr + from, 0, to - from);
+
+	/* the callback gets the line in one piece */
+	cli_line_move(line, len);
+	n = hl->cb(line->buf ? line->buf : "", len, from, to, spans, CLI_HIGHLIGHT_SPANS, hl->arg);
+	cli_line_move(line, gap);
+
+	hl->lo = from;
+	hl->hi = to;
+	for (i = 0; i < n && i < CLI_HIGHLIGHT_SPANS; i++) {
+		if (spans[i].start >= len) {
+			continue;
+		}
+		end = spans[i].len < len - spans[i].start ? spans[i].start + spans[i].len : len;
+		memset(hl->attr + spans[i].start, spans[i].attr < hl->npalette ? spans[i].attr : 0,
+		       end - spans[i].start);
+		hl->lo = spans[i].start < hl->lo ? spans[i].start : hl->lo;
+		hl->hi = end > hl->hi ? end : hl->hi;
+	}
+
+	return 0;
+}
+
+/* SGR parameters of the suggestions */
+#ifndef CLI_SUGGEST_SGR
+#define CLI_SUGGEST_SGR "90"
+#endif
+
+/**
+ * Check if the suggestion displayed after the line is still the right one,
+ * possibly after some of it was typed.
+ */
+static inline int
+cli_ghost_valid(struct cli_session *s)
+{
+	struct cli_screen *scr = &s->scr;
+	size_t n = 0;
+
+	if (scr->op == CLI_OP_INSERT && scr->op_pos == scr->len && scr->op_len <= scr->ghost_len) {
+		/* typed over it */
+		for (n = 0; n < scr->op_len; n++) {
+			if (cli_line_at(&s->line, scr->op_pos + n) != scr->ghost[n]) {
+				return 0;
+			}
+		}
+	} else if (scr->op != CLI_OP_NONE) {
+		return 0;
+	}
+
+	if (s->sugg_len != scr->ghost_len - n ||
+	    memcmp(s->sugg, scr->ghost + n, s->sugg_len) != 0) {
+		return 0;
+	}
+	scr->ghost = s->sugg;
+	scr->ghost_len = s->sugg_len;
+	return 1;
+}
+
+static inline void
+cli_session_redraw(struct cli_session *s, size_t cur)
+{
+	struct cli_highlight *hl = NULL;
+	struct cli_screen *scr = &s->scr;
+	int failed = 0;
+
+	if (s->raw && s->winch != cli_winch) {
+		cli_session_winsize(s);
+		s->scr.prompt_dirty = 1;
+	}
+
+	if (s->scr.prompt_dirty || (s->scr.op == CLI_OP_MIXED && s->scr.op_pos == 0)) {
+		CLI_STAT_ADD(s, full_redraws, 1);
+	} else if (s->scr.op != CLI_OP_NONE || s->scr.cur != cur) {
+		CLI_STAT_ADD(s, incremental_redraws, 1);
+	}
+
+	if (s->scr.prompt_dirty) {
+		cli_draw_prompt(s);
+	}
+
+	if (s->hl.cb) {
+		if (cli_highlight(s) == 0) {
+			hl = &s->hl;
+		} else {
+			/* draw it plain, and try again next time */
+			failed = 1;
+		}
+	}
+
+	if (scr->ghost_len > 0 && !cli_ghost_valid(s)) {
+		cli_move_cursor(&s->out, scr->cur, scr->len);
+		cli_out_str(&s->out, "\033[K");
+		scr->cur = scr->len;
+		scr->ghost_len = 0;
+	}
+
+	cli_redraw(&s->out, scr, &s->line, cur, hl);
+	if (failed) {
+		cli_screen_invalidate(scr, 0);
+	}
+
+	if (s->sugg_len > 0 && scr->ghost_len == 0 &&
+	    (scr->width == 0 || scr->len + s->sugg_len <= scr->off + scr->width)) {
+		cli_move_cursor(&s->out, scr->cur, scr->len);
+		cli_out_str(&s->out, "\033[" CLI_SUGGEST_SGR "m");
+		cli_out_write(&s->out, s->sugg, s->sugg_len);
+		cli_out_str(&s->out, "\033[m");
+		scr->ghost = s->sugg;
+		scr->ghost_len = s->sugg_len;
+		cli_move_cursor(&s->out, scr->len + scr->ghost_len, cur);
+	}
+}
+
+/* remember an edit of the line, see cli_undo_add() */
+static inline int
+cli_undo_record(struct cli_session *s, int insert, size_t pos, const char *text, size_t n,
+		int mode)
+{
+	if (s->search.active || n == 0) {
+		/* the search result is recorded as a whole once it's accepted */
+		return -1;
+	}
+	return cli_undo_add(&s->undo, insert, pos, text, n, mode);
+}
+
+/**
+ * Remember a run of typed text, which came in a single read, e.g. typed
+ * ahead. It's split into words the same way as separate key presses.
+ */
+static inline void
+cli_undo_record_typed(struct cli_session *s, size_t pos, const char *text, size_t n)
+{
+	size_t i, start = 0;
+
+	for (i = 1; i < n; i++) {
+		if (text[i] == ' ' && text[i - 1] != ' ') {
+			cli_undo_record(s, 1, pos + start, text + start, i - start, CLI_UNDO_KEY);
+			start = i;
+		}
+	}
+	cli_undo_record(s, 1, pos + start, text + start, n - start, CLI_UNDO_KEY);
+}
+
+/**
+ * Remember the whole line as inserted or deleted, when it's replaced.
+ *
+ * \return mode for recording the next edit of the same group
+ */
+static inline int
+cli_undo_line(struct cli_session *s, int insert, int mode)
+{
+	struct cli_line *line = &s->line;
+
+	if (cli_undo_record(s, insert, 0, line->buf, line->gap, mode) == 0) {
+		mode = CLI_UNDO_NEXT;
+	}
+	if (cli_undo_record(s, insert, insert ? line->gap : 0, line->buf + line->end,
+			    line->size - line->end, mode) == 0) {
+		mode = CLI_UNDO_NEXT;
+	}
+	return mode;
+}
+
+/* show the current search match, if any */
+static inline void
+cli_search_show(struct cli_session *s)
+{
+	struct cli_history *h = &s->hist;
+	struct cli_search *q = &s->search;
+	struct cli_history_entry *e;
+
+	s->scr.prompt_dirty = 1;
+	if (q->cur < h->nmatches) {
+		h->pos = h->matches[q->cur];
+		e = cli_history_at(h, h->pos);
+		cli_line_set(&s->line, h->arena + e->off, e->len);
+	}
+}
+
+static inline void
+cli_search_start(struct cli_session *s)
+{
+	struct cli_search *q = &s->search;
+
+	if (s->hist.count == 0 || cli_history_stash(&s->hist, &s->line) != 0) {
+		return;
+	}
+
+	q->undo = cli_undo_line(s, 0, CLI_UNDO_GROUP);
+	q->active = 1;
+	q->len = 0;
+	q->cur = 0;
+	s->hist.nmatches = 0;
+	s->scr.prompt_dirty = 1;
+}
+
+/* leave the search, with the line it found (or restored) */
+static inline void
+cli_search_end(struct cli_session *s)
+{
+	s->search.active = 0;
+	s->scr.prompt_dirty = 1;
+	cli_undo_line(s, 1, s->search.undo);
+}
+
+/**
+ * Handle a key press during the ctrl-r search. Typing extends the query and
+ * only narrows down the previous matches, ctrl-r moves to the next older
+ * match, and ctrl-g cancels the search. Any other key accepts the current
+ * match and should then be handled as usual.
+ *
+ * \return 1 if the key was consumed, 0 otherwise
+ */
+static inline int
+cli_search_key(struct cli_session *s, unsigned char b)
+{
+	struct cli_history *h = &s->hist;
+	struct cli_search *q = &s->search;
+
+	switch (b) {
+	case 0x12: /* ctrl-r */
+		if (q->cur + 1 < h->nmatches) {
+			q->cur++;
+		}
+		break;
+	case 0x7F: /* backspace */
+		if (q->len > 0) {
+			q->len--;
+			q->cur = 0;
+			/* the previous matches are a subset, search from scratch */
+			h->nmatches = 0;
+			if (q->len > 0) {
+				cli_history_search(h, q->query, q->len, 0, &q->cur);
+			}
+		}
+		break;
+	case 0x7: /* ctrl-g */
+		h->pos = h->count;
+		cli_line_set(&s->line, h->stash, h->stash_len);
+		cli_search_end(s);
+		return 1;
+	default:
+		if (b < 0x20 || b == 0x7F || q->len == sizeof(q->query)) {
+			cli_search_end(s);
+			return 0;
+		}
+		q->query[q->len++] = b;
+		cli_history_search(h, q->query, q->len, q->len > 1, &q->cur);
+		break;
+	}
+
+	cli_search_show(s);
+	return 1;
+}
+
+/* values of cli_session.state */
+#define CLI_STATE_IDLE 0 /* no line is being read */
+#define CLI_STATE_EDITING 1
+#define CLI_STATE_DRAINING 2 /* the line is full, discard input until CR */
+#define CLI_STATE_READY 3 /* the line is complete, but not retrieved yet */
+
+/**
+ * Make cb_buf big enough for the current line and for whatever history_cb
+ * may put there.
+ *
+ * \return size of the buffer to pass to history_cb, 0 if it couldn't be
+ *         allocated
+ */
+static inline size_t
+cli_cb_buf(struct cli_session *s)
+{
+	size_t len = cli_line_len(&s->line);
+	size_t blen = s->line.max != CLI_LINE_UNLIMITED ? s->line.max + 1 : CLI_LINE_MAX + 1;
+	char *cb_buf;
+
+	if (blen < len + 1) {
+		blen = len + 1;
+	}
+
+	if (blen > s->cb_size) {
+		cb_buf = (char *)realloc(s->cb_buf, blen);
+		if (cb_buf == NULL) {
+			return 0;
+		}
+		s->cb_buf = cb_buf;
+		s->cb_size = blen;
+	}
+
+	return blen;
+}
+
+/* marks the end of the bracketed paste */
+static const char cli_paste_end[] = "\033[201~";
+
+/**
+ * Find the first control character (including ESC and DEL) in the input.
+ * Everything before it is just text, which doesn't need to go through
+ * cli_key() one byte at a time.
+ *
+ * \return its index, or n if there's none
+ */
+static inline size_t
+cli_scan_ctrl(const unsigned char *data, size_t n)
+{
+	size_t i = 0;
+
+	/* c < 0x20 is checked as min(c, 0x1F) == c, since there are
+	 * only signed comparisons for bytes */
+#if defined(__AVX2__)
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i c = _mm256_or_si256(
+			_mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(0x1F)), x),
+			_mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x7F)));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(c);
+
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i c = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1F)), x),
+					 _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7F)));
+		unsigned mask = (unsigned)_mm_movemask_epi8(c);
+
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t x = vld1q_u8(data + i);
+		uint8x16_t c = vorrq_u8(vcltq_u8(x, vdupq_n_u8(0x20)), vceqq_u8(x, vdupq_n_u8(0x7F)));
+
+		if (vmaxvq_u8(c)) {
+			/* the exact position is found below */
+			break;
+		}
+	}
+#endif
+
+	while (i < n && data[i] >= 0x20 && data[i] != 0x7F) {
+		i++;
+	}
+	return i;
+}
+
+/* insert text at the cursor, as much as fits in the line */
+static inline size_t
+cli_insert_text(struct cli_session *s, const char *text, size_t n)
+{
+	size_t pos = s->line.gap, done;
+
+	done = cli_line_insert_n(&s->line, text, n);
+	s->dropped += n - done;
+	if (done > 0) {
+		cli_screen_insert(&s->scr, pos, done);
+	}
+	return done;
+}
+
+/* insert pasted text, as much as fits in the line */
+static inline void
+cli_paste_text(struct cli_session *s, const char *text, size_t n)
+{
+	struct cli_line *line = &s->line;
+	size_t i, pos = line->gap;
+
+	n = cli_insert_text(s, text, n);
+
+	/* pasted control characters are just text */
+	for (i = pos; i < pos + n; i++) {
+		if ((unsigned char)line->buf[i] < 0x20 || line->buf[i] == 0x7F) {
+			line->buf[i] = ' ';
+		}
+	}
+	cli_undo_record(s, 1, pos, line->buf + pos, n, CLI_UNDO_KEY);
+}
+
+/**
+ * Handle input of a bracketed paste. All of it is inserted into the line
+ * in bulk, until the end marker.
+ *
+ * \return number of processed bytes
+ */
+static inline size_t
+cli_paste(struct cli_session *s, const unsigned char *data, size_t n)
+{
+	const unsigned char *esc;
+	size_t i = 0, run;
+
+	while (i < n) {
+		if (s->paste_match > 0) {
+			/* in the middle of what might be the end marker */
+			if (data[i] == (unsigned char)cli_paste_end[s->paste_match]) {
+				i++;
+				if (++s->paste_match == sizeof(cli_paste_end) - 1) {
+					s->paste_match = 0;
+					s->pasting = 0;
+					/* the paste is undone on its own */
+					s->undo.open = 0;
+					break;
+				}
+				continue;
+			}
+
+			/* it was just text */
+			cli_paste_text(s, cli_paste_end, s->paste_match);
+			s->paste_match = 0;
+		}
+
+		esc = (const unsigned char *)memchr(data + i, 0x1b, n - i);
+		run = esc ? (size_t)(esc - data) - i : n - i;
+		cli_paste_text(s, (const char *)data + i, run);
+		i += run;
+		if (esc) {
+			s->paste_match = 1;
+			i++;
+		}
+	}
+
+	return i;
+}
+
+/* find the suggestion for the line, if the cursor is at its end */
+static inline void
+cli_suggest(struct cli_session *s)
+{
+	struct cli_history *h = &s->hist;
+	struct cli_line *line = &s->line;
+	const struct cli_history_entry *e;
+
+	s->sugg_len = 0;
+	if (!CLI_GETS_HISTORY || !s->suggest || s->history_cb || s->search.active || s->state != CLI_STATE_EDITING ||
+	    line->gap == 0 || line->gap != cli_line_len(line)) {
+		return;
+	}
+
+	if (h->trie == NULL && h->count > 0) {
+		cli_trie_build(h);
+	}
+
+	/* with the cursor at the end, the line is in one piece */
+	if (h->trie) {
+		e = cli_trie_find(h, line->buf, line->gap);
+	} else {
+		e = cli_history_prefix(h, line->buf, line->gap);
+	}
+	if (e) {
+		s->sugg = h->arena + e->off + line->gap;
+		s->sugg_len = e->len - line->gap;
+	}
+}
+
+/* replace [start, cursor) with the completion */
+static inline void
+cli_complete_replace(struct cli_session *s, size_t start, const char *text, size_t n)
+{
+	struct cli_line *line = &s->line;
+	int mode = CLI_UNDO_GROUP;
+	size_t done;
+
+	if (cli_undo_record(s, 0, start, line->buf + start, line->gap - start, mode) == 0) {
+		mode = CLI_UNDO_NEXT;
+	}
+	line->gap = start;
+	cli_screen_invalidate(&s->scr, start);
+	done = cli_insert_text(s, text, n);
+	cli_undo_record(s, 1, start, line->buf + start, done, mode);
+}
+
+/* keep the candidates for displaying them page by page */
+static inline int
+cli_complete_save(struct cli_complete *c, const char *const *cands, size_t n)
+{
+	size_t i, len, total = 0;
+	char *buf;
+
+	c->width = 0;
+	for (i = 0; i < n; i++) {
+		len = strlen(cands[i]);
+		total += len + 1;
+		c->width = len > c->width ? len : c->width;
+	}
+
+	if (total > c->size) {
+		buf = (char *)realloc(c->cands, total);
+		if (buf == NULL) {
+			return -1;
+		}
+		c->cands = buf;
+		c->size = total;
+	}
+
+	for (i = 0, total = 0; i < n; i++) {
+		len = strlen(cands[i]) + 1;
+		memcpy(c->cands + total, cands[i], len);
+		total += len;
+	}
+	c->n = n;
+	c->shown = 0;
+	return 0;
+}
+
+/**
+ * Display the next page of the candidates below the line, in as many
+ * columns as fit. The line is drawn again below them.
+ */
+static inline void
+cli_complete_page(struct cli_session *s)
+{
+	static const char spaces[] = "                                ";
+	struct cli_complete *c = &s->comp;
+	struct cli_screen *scr = &s->scr;
+	size_t cols = s->cols ? s->cols : 80, rows = s->rows ? s->rows : 24;
+	size_t width = c->width + 2, per_row, per_page, i, n, pad;
+	const char *cand = c->cands;
+	char more[64];
+
+	per_row = cols / width > 0 ? cols / width : 1;
+	per_page = per_row * (rows > 3 ? rows - 2 : 1);
+
+	for (i = 0; i < c->shown; i++) {
+		cand += strlen(cand) + 1;
+	}
+
+	/* the line may be behind if tab came along with other input */
+	cli_session_redraw(s, s->line.gap);
+	cli_move_cursor(&s->out, scr->cur, cli_screen_end(scr));
+	cli_out_str(&s->out, "\033[K\r\n");
+
+	for (i = 0; i < per_page && c->shown < c->n; i++) {
+		n = strlen(cand);
+		cli_out_write(&s->out, cand, n);
+		cand += n + 1;
+		c->shown++;
+		if ((i + 1) % per_row == 0 || c->shown == c->n) {
+			cli_out_str(&s->out, "\r\n");
+			continue;
+		}
+		for (pad = width - n; pad > 0; pad -= n) {
+			n = pad < sizeof(spaces) - 1 ? pad : sizeof(spaces) - 1;
+			cli_out_write(&s->out, spaces, n);
+		}
+	}
+
+	if (c->shown < c->n) {
+		n = snprintf(more, sizeof(more), "-- %zu more --\r\n",
+			     c->n - c->shown);
+		cli_out_write(&s->out, more, n);
+	}
+	scr->prompt_dirty = 1;
+}
+
+/* whether the line is still as it was when tab was pressed */
+static inline int
+cli_complete_current(struct cli_session *s)
+{
+	struct cli_complete *c = &s->comp;
+
+	return s->state == CLI_STATE_EDITING && s->line.gap == c->pos &&
+	       cli_line_len(&s->line) == c->len && cli_line_hash(&s->line) == c->hash;
+}
+
+/*
+ * The built-in actions. They can also be bound to other keys.
+ */
+
+static inline int
+cli_act_insert(struct cli_session *s, int key)
+{
+	struct cli_line *line = &s->line;
+
+	if (cli_line_insert(line, (char)key) == 0) {
+		cli_screen_insert(&s->scr, line->gap - 1, 1);
+		cli_undo_record(s, 1, line->gap - 1, line->buf + line->gap - 1, 1, CLI_UNDO_KEY);
+	} else {
+		s->dropped++;
+	}
+	return CLI_NEED_MORE;
+}
+
+static inline int
+cli_act_accept(struct cli_session *s, int key)
+{
+	(void)s;
+	(void)key;
+	return CLI_LINE_READY;
+}
+
+/* ctrl-c and ctrl-z, which on a telnet connection end just the session */
+static inline int
+cli_act_interrupt(struct cli_session *s, int key)
+{
+	if (s->telnet.enabled) {
+		/* the process may be serving other clients */
+		return CLI_EOF;
+	}
+
+	cli_tty_restore(s);
+	cli_out_str(&s->out, "\n");
+	cli_session_flush(s);
+	exit(key == CLI_CTRL('c') ? 0 : 1);
+	return CLI_EOF;
+}
+
+static inline int
+cli_act_escape(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_esc_start(&s->esc);
+	return CLI_NEED_MORE;
+}
+
+static inline int
+cli_act_backspace(struct cli_session *s, int key)
+{
+	struct cli_line *line = &s->line;
+
+	(void)key;
+	/* if there are character behind the cursor */
+	if (line->gap > 0) {
+		line->gap--;
+		cli_undo_record(s, 0, line->gap, line->buf + line->gap, 1, CLI_UNDO_KEY);
+		cli_screen_delete(&s->scr, line->gap, 1);
+	}
+	return CLI_NEED_MORE;
+}
+
+static inline int
+cli_act_delete(struct cli_session *s, int key)
+{
+	struct cli_line *line = &s->line;
+
+	(void)key;
+	/* if there is a character at the cursor */
+	if (line->end < line->size) {
+		cli_undo_record(s, 0, line->gap, line->buf + line->end, 1, CLI_UNDO_KEY);
+		line->end++;
+		cli_screen_delete(&s->scr, line->gap, 1);
+	}
+	return CLI_NEED_MORE;
+}
+
+/* ctrl-d, the end of input on an empty line, delete otherwise */
+static inline int
+cli_act_eof(struct cli_session *s, int key)
+{
+	if (cli_line_len(&s->line) == 0) {
+		return CLI_EOF;
+	}
+	return cli_act_delete(s, key);
+}
+
+static inline int
+cli_act_left(struct cli_session *s, int key)
+{
+	struct cli_line *line = &s->line;
+
+	(void)key;
+	if (line->gap > 0) {
+		line->buf[--line->end] = line->buf[--line->gap];
+	}
+	return CLI_NEED_MORE;
+}
+
+static inline int
+cli_act_right(struct cli_session *s, int key)
+{
+	struct cli_line *line = &s->line;
+	size_t pos = line->gap, done;
+
+	(void)key;
+	if (line->end < line->size) {
+		line->buf[line->gap++] = line->buf[line->end++];
+		return CLI_NEED_MORE;
+	}
+
+	/* at the end of the line, accept the suggestion */
+	cli_suggest(s);
+	if (s->sugg_len > 0) {
+		done = cli_insert_text(s, s->sugg, s->sugg_len);
+		cli_undo_record(s, 1, pos, line->buf + pos, done, CLI_UNDO_GROUP);
+	}
+	return CLI_NEED_MORE;
+}
+
+/* to the start of the previous word */
+static inline int
+cli_act_word_left(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_line_move(&s->line, cli_line_word(&s->line, -1));
+	return CLI_NEED_MORE;
+}
+
+/* to the end of the next word */
+static inline int
+cli_act_word_right(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_line_move(&s->line, cli_line_word(&s->line, 1));
+	return CLI_NEED_MORE;
+}
+
+static inline int
+cli_act_home(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_line_move(&s->line, 0);
+	return CLI_NEED_MORE;
+}
+
+static inline int
+cli_act_end(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_line_move(&s->line, cli_line_len(&s->line));
+	return CLI_NEED_MORE;
+}
+
+/* ctrl-k, delete everything after the cursor */
+static inline int
+cli_act_kill_end(struct cli_session *s, int key)
+{
+	struct cli_line *line = &s->line;
+
+	(void)key;
+	if (line->end < line->size) {
+		cli_undo_record(s, 0, line->gap, line->buf + line->end, line->size - line->end,
+				CLI_UNDO_GROUP);
+		cli_screen_delete(&s->scr, line->gap, line->size - line->end);
+		line->end = line->size;
+	}
+	return CLI_NEED_MORE;
+}
+
+/* ctrl-u, delete everything before the cursor */
+static inline int
+cli_act_kill_start(struct cli_session *s, int key)
+{
+	struct cli_line *line = &s->line;
+
+	(void)key;
+	if (line->gap > 0) {
+		cli_undo_record(s, 0, 0, line->buf, line->gap, CLI_UNDO_GROUP);
+		cli_screen_delete(&s->scr, 0, line->gap);
+		line->gap = 0;
+	}
+	return CLI_NEED_MORE;
+}
+
+/* ctrl-w, delete the word before the cursor */
+static inline int
+cli_act_kill_word(struct cli_session *s, int key)
+{
+	struct cli_line *line = &s->line;
+	size_t pos = cli_line_word(line, -1);
+
+	(void)key;
+	if (pos < line->gap) {
+		cli_undo_record(s, 0, pos, line->buf + pos, line->gap - pos, CLI_UNDO_GROUP);
+		cli_screen_delete(&s->scr, pos, line->gap - pos);
+		line->gap = pos;
+	}
+	return CLI_NEED_MORE;
+}
+
+/* go to the previous (dir < 0) or the next history entry */
+static inline void
+cli_history_move(struct cli_session *s, int dir)
+{
+	struct cli_line *line = &s->line;
+	int mode = cli_undo_line(s, 0, CLI_UNDO_GROUP);
+	size_t blen;
+
+	if (s->history_cb && (blen = cli_cb_buf(s)) > 0) {
+		cli_line_copy(line, s->cb_buf);
+		s->history_cb(dir, s->cb_buf, blen);
+		CLI_STAT_ADD(s, history_cb_calls, 1);
+		cli_line_set(line, s->cb_buf, strlen(s->cb_buf));
+	} else if (s->history_cb || !CLI_GETS_HISTORY ||
+		   cli_history_browse(&s->hist, line, dir) != 0) {
+		if (mode == CLI_UNDO_NEXT) {
+			cli_undo_pop(&s->undo);
+		}
+		return;
+	}
+
+	cli_screen_invalidate(&s->scr, 0);
+	cli_undo_line(s, 1, mode);
+}
+
+static inline int
+cli_act_history_prev(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_history_move(s, -1);
+	return CLI_NEED_MORE;
+}
+
+static inline int
+cli_act_history_next(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_history_move(s, 1);
+	return CLI_NEED_MORE;
+}
+
+/* ctrl-r */
+static inline int
+cli_act_search(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_search_start(s);
+	return CLI_NEED_MORE;
+}
+
+/* the start of a bracketed paste */
+static inline int
+cli_act_paste(struct cli_session *s, int key)
+{
+	(void)key;
+	s->pasting = 1;
+	s->undo.open = 0;
+	if (s->search.active) {
+		cli_search_end(s);
+	}
+	return CLI_NEED_MORE;
+}
+
+/* tab */
+static inline int
+cli_act_complete(struct cli_session *s, int key)
+{
+	struct cli_complete *c = &s->comp;
+	struct cli_line *line = &s->line;
+
+	if (c->cb == NULL) {
+		return cli_act_insert(s, key);
+	}
+
+	if (c->n > 0 && c->shown < c->n && cli_complete_current(s)) {
+		/* the list that is displayed continues */
+		cli_complete_page(s);
+		return CLI_NEED_MORE;
+	}
+
+	if (cli_cb_buf(s) == 0) {
+		return CLI_NEED_MORE;
+	}
+	cli_line_copy(line, s->cb_buf);
+	c->pos = line->gap;
+	c->len = cli_line_len(line);
+	c->hash = cli_line_hash(line);
+	c->n = 0;
+	c->pending = 1;
+
+	c->in_cb = 1;
+	c->cb(s, s->cb_buf, c->len, c->pos, c->arg);
+	c->in_cb = 0;
+	return CLI_NEED_MORE;
+}
+
+/* ctrl-_ */
+static inline int
+cli_act_undo(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_undo_step(&s->undo, &s->line, &s->scr, 0);
+	return CLI_NEED_MORE;
+}
+
+/* ctrl-^ */
+static inline int
+cli_act_redo(struct cli_session *s, int key)
+{
+	(void)key;
+	cli_undo_step(&s->undo, &s->line, &s->scr, 1);
+	return CLI_NEED_MORE;
+}
+
+#define CLI_KB4(a) a, a, a, a
+#define CLI_KB16(a) CLI_KB4(a), CLI_KB4(a), CLI_KB4(a), CLI_KB4(a)
+
+/* ctrl-r is just inserted without the built-in history */
+#define CLI_KB_SEARCH (CLI_GETS_HISTORY ? cli_act_search : cli_act_insert)
+
+static const struct cli_keymap cli_keymap_default = {
+	{
+		/* 0x00 */
+		cli_act_insert, cli_act_home, cli_act_insert, cli_act_interrupt,
+		cli_act_eof, cli_act_end, cli_act_insert, cli_act_insert,
+		cli_act_insert, cli_act_complete, cli_act_insert, cli_act_kill_end,
+		cli_act_insert, cli_act_accept, cli_act_insert, cli_act_insert,
+		/* 0x10 */
+		cli_act_insert, cli_act_insert, CLI_KB_SEARCH, cli_act_insert,
+		cli_act_insert, cli_act_kill_start, cli_act_insert, cli_act_kill_word,
+		cli_act_insert, cli_act_insert, cli_act_interrupt, cli_act_escape,
+		cli_act_insert, cli_act_insert, cli_act_redo, cli_act_undo,
+		/* 0x20 - 0x7E */
+		CLI_KB16(cli_act_insert), CLI_KB16(cli_act_insert), CLI_KB16(cli_act_insert),
+		CLI_KB16(cli_act_insert), CLI_KB16(cli_act_insert), CLI_KB4(cli_act_insert),
+		CLI_KB4(cli_act_insert), CLI_KB4(cli_act_insert),
+		cli_act_insert, cli_act_insert, cli_act_insert,
+		/* 0x7F */
+		cli_act_backspace,
+		/* 0x80 - 0xFF */
+		CLI_KB16(cli_act_insert), CLI_KB16(cli_act_insert), CLI_KB16(cli_act_insert),
+		CLI_KB16(cli_act_insert), CLI_KB16(cli_act_insert), CLI_KB16(cli_act_insert),
+		CLI_KB16(cli_act_insert), CLI_KB16(cli_act_insert),
+	},
+#if CLI_GETS_ESCAPES
+	{
+		/* none, shift, alt, shift+alt, ctrl, ... */
+		{ CLI_KB4(NULL), CLI_KB4(NULL) }, /* CLI_KEY_NONE */
+		{ CLI_KB4(cli_act_history_prev), CLI_KB4(cli_act_history_prev) }, /* CLI_KEY_UP */
+		{ CLI_KB4(cli_act_history_next), CLI_KB4(cli_act_history_next) }, /* CLI_KEY_DOWN */
+		{ cli_act_right, cli_act_right, cli_act_word_right, cli_act_word_right,
+		  CLI_KB4(cli_act_word_right) }, /* CLI_KEY_RIGHT */
+		{ cli_act_left, cli_act_left, cli_act_word_left, cli_act_word_left,
+		  CLI_KB4(cli_act_word_left) }, /* CLI_KEY_LEFT */
+		{ CLI_KB4(cli_act_home), CLI_KB4(cli_act_home) }, /* CLI_KEY_HOME */
+		{ CLI_KB4(cli_act_end), CLI_KB4(cli_act_end) }, /* CLI_KEY_END */
+		{ CLI_KB4(NULL), CLI_KB4(NULL) }, /* CLI_KEY_INSERT */
+		{ CLI_KB4(cli_act_delete), CLI_KB4(cli_act_delete) }, /* CLI_KEY_DELETE */
+		{ CLI_KB4(NULL), CLI_KB4(NULL) }, /* CLI_KEY_PAGE_UP */
+		{ CLI_KB4(NULL), CLI_KB4(NULL) }, /* CLI_KEY_PAGE_DOWN */
+		{ CLI_KB4(cli_act_paste), CLI_KB4(cli_act_paste) }, /* CLI_KEY_PASTE_START */
+		{ CLI_KB4(NULL), CLI_KB4(NULL) }, /* CLI_KEY_PASTE_END */
+	},
+	{
+		/* 0x00 - 0x5F */
+		CLI_KB16(NULL), CLI_KB16(NULL), CLI_KB16(NULL),
+		CLI_KB16(NULL), CLI_KB16(NULL), CLI_KB16(NULL),
+		/* 0x60, alt-b and alt-f */
+		NULL, NULL, cli_act_word_left, NULL, NULL, NULL, cli_act_word_right, NULL,
+		CLI_KB4(NULL), CLI_KB4(NULL),
+		/* 0x70 - 0x7F */
+		CLI_KB16(NULL),
+	},
+#endif
+	0,
+};
+
+static inline const struct cli_keymap *
+cli_keymap(const struct cli_session *s)
+{
+	return s->keys ? s->keys : &cli_keymap_default;
+}
+
+#if CLI_GETS_ESCAPES
+/* handle a special key, or an alt+character */
+static inline int
+cli_escape(struct cli_session *s, int key, int mod)
+{
+	const struct cli_keymap *km = cli_keymap(s);
+	cli_action action = NULL;
+
+	CLI_STAT_ADD(s, escapes, 1);
+	if (key >= CLI_KEY_NONE) {
+		action = km->key[key - CLI_KEY_NONE][mod & 7];
+	} else if (key < 0x80) {
+		action = km->alt[key];
+	}
+
+	return action ? action(s, key) : CLI_NEED_MORE;
+}
+#endif
+
+/**
+ * Bind a key to an action, either one of the built-in cli_act_* ones or
+ * a custom one. The first call makes a private copy of the default key
+ * map for the session.
+ *
+ * Only the cursor movements are redrawn on their own. An action that
+ * changes the text should also report it with cli_screen_insert(),
+ * cli_screen_delete(), or cli_screen_invalidate() from the position of the
+ * first changed character.
+ *
+ * \param s session
+ * \param key a byte, e.g. CLI_CTRL('a'), one of CLI_KEY_*, or a character
+ *        to be pressed together with alt
+ * \param mod CLI_MOD_* combination for CLI_KEY_*, CLI_MOD_ALT for the alt
+ *        characters, 0 for the bytes
+ * \param action function to call, NULL to ignore the key
+ * \return 0 on success, -1 if the key is invalid (any special or alt key
+ *         without CLI_GETS_ESCAPES) or the memory couldn't be allocated
+ */
+static inline int
+cli_bind_key(struct cli_session *s, int key, int mod, cli_action action)
+{
+	struct cli_keymap *km = s->keys;
+
+	if (key < 0 || key >= CLI_KEY_NONE + CLI_KEY_COUNT || mod < 0 || mod > 7 ||
+	    (key < CLI_KEY_NONE && mod != 0 && (mod != CLI_MOD_ALT || key >= 0x80)) ||
+	    (!CLI_GETS_ESCAPES && (key >= CLI_KEY_NONE || mod != 0))) {
+		return -1;
+	}
+
+	if (km == NULL) {
+		km = (struct cli_keymap *)malloc(sizeof(*km));
+		if (km == NULL) {
+			return -1;
+		}
+		memcpy(km, &cli_keymap_default, sizeof(*km));
+		s->keys = km;
+	}
+
+	if (key >= CLI_KEY_NONE || mod != 0) {
+#if CLI_GETS_ESCAPES
+		if (key >= CLI_KEY_NONE) {
+			km->key[key - CLI_KEY_NONE][mod] = action;
+		} else {
+			km->alt[key] = action;
+		}
+#endif
+	} else {
+		km->byte[key] = action;
+		if (key >= 0x20 && key != 0x7F && action != cli_act_insert) {
+			/* it can't be inserted in bulk anymore */
+			km->bind_text = 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Complete the word before the cursor with tab.
+ *
+ * \param s session
+ * \param cb callback to find the completions, NULL to insert tabs instead
+ * \param arg passed to cb
+ */
+static inline void
+cli_session_set_completion(struct cli_session *s, cli_complete_cb cb, void *arg)
+{
+	s->comp.cb = cb;
+	s->comp.arg = arg;
+}
+
+/**
+ * Pass the completions found by cli_complete_cb. The word is extended to
+ * the common prefix of the candidates, as long as that starts with what
+ * was typed and is longer. Otherwise the line is left alone, and the
+ * candidates are listed below it, a screen at a time, or just the bell
+ * rings if there's one or none. Tab shows the next page.
+ *
+ * This can be called from the callback, or later from the thread reading
+ * the input, and then the line is redrawn right away. Everything is
+ * drawn with a single write.
+ *
+ * \param s session
+ * \param start where the completed word begins, it ends at the cursor
+ * \param cands the candidates for the word. Nothing is appended to
+ *        them, so e.g. a trailing space should be added by the callback.
+ * \param n number of candidates, 0 if none was found
+ * \return 0 on success, -1 if the line has changed in the meantime, or the
+ *         memory couldn't be allocated
+ */
+static inline int
+cli_session_complete(struct cli_session *s, size_t start, const char *const *cands, size_t n)
+{
+	struct cli_complete *c = &s->comp;
+	struct cli_line *line = &s->line;
+	size_t i, j, common, word;
+	int rc = 0;
+
+	if (!c->pending || !cli_complete_current(s)) {
+		return -1;
+	}
+	c->pending = 0;
+
+	start = start < c->pos ? start : c->pos;
+	word = c->pos - start;
+	common = n > 0 ? strlen(cands[0]) : 0;
+	for (i = 1; i < n; i++) {
+		for (j = 0; j < common && cands[i][j] == cands[0][j]; j++);
+		common = j;
+	}
+
+	if (n > 0 && common > word &&
+	    (word == 0 || memcmp(line->buf + start, cands[0], word) == 0)) {
+		/* what was typed is extended, never replaced */
+		cli_complete_replace(s, start, cands[0], common);
+	} else if (n < 2) {
+		cli_out_str(&s->out, "\a");
+	} else if ((rc = cli_complete_save(c, cands, n)) == 0) {
+		cli_complete_page(s);
+	}
+
+	if (!c->in_cb) {
+		/* it came from elsewhere */
+		cli_suggest(s);
+		cli_session_redraw(s, line->gap);
+		cli_session_flush(s);
+	}
+	return rc;
+}
+
+/**
+ * Handle a single input byte.
+ *
+ * \return CLI_LINE_READY or CLI_EOF to stop processing the input,
+ *         CLI_NEED_MORE otherwise
+ */
+static inline int
+cli_key(struct cli_session *s, unsigned char b)
+{
+	cli_action action;
+
+	if (s->esc.state != CLI_ESC_NONE) {
+		/* in the middle of an escape sequence */
+		int rc = cli_esc_feed(&s->esc, b);
+
+		if (rc == CLI_ESC_DONE) {
+#if CLI_GETS_ESCAPES
+			return cli_escape(s, s->esc.key, s->esc.mod);
+#else
+			return CLI_NEED_MORE;
+#endif
+		}
+		if (rc != CLI_ESC_NOT) {
+			return CLI_NEED_MORE;
+		}
+	}
+
+	if (CLI_GETS_HISTORY && s->search.active && cli_search_key(s, b)) {
+		return CLI_NEED_MORE;
+	}
+
+	action = cli_keymap(s)->byte[b];
+	return action ? action(s, b) : CLI_NEED_MORE;
+}
+
+/**
+ * Show the messages from cli_session_print(), if there are any. The line
+ * being edited is cleared first and then drawn again below them.
+ */
+static inline void
+cli_print_show(struct cli_session *s)
+{
+	struct cli_print *p = &s->print;
+	int editing = !s->plain && (s->state == CLI_STATE_EDITING ||
+				    s->state == CLI_STATE_DRAINING);
+	const char *nl;
+	size_t i, n;
+
+	pthread_mutex_lock(&p->lock);
+	cli_print_unwake(p);
+	if (p->len == 0) {
+		pthread_mutex_unlock(&p->lock);
+		return;
+	}
+	p->last_ns = cli_now_ns();
+
+	if (editing) {
+		cli_out_str(&s->out, "\r\033[J");
+	}
+	if (s->plain) {
+		cli_out_write(&s->out, p->buf, p->len);
+	} else {
+		/* the terminal doesn't turn \n into \r\n in the raw mode */
+		for (i = 0; i < p->len; i += n) {
+			nl = (const char *)memchr(p->buf + i, '\n', p->len - i);
+			n = nl ? (size_t)(nl - p->buf) - i : p->len - i;
+			cli_out_write(&s->out, p->buf + i, n);
+			if (nl) {
+				cli_out_str(&s->out, "\r\n");
+				n++;
+			}
+		}
+	}
+	p->len = 0;
+	pthread_mutex_unlock(&p->lock);
+
+	if (editing) {
+		s->scr.prompt_dirty = 1;
+		cli_session_redraw(s, s->line.gap);
+	}
+}
+
+/**
+ * Show the messages if they're due, considering the max rate.
+ *
+ * \return how many milliseconds to wait before trying again, or -1 if
+ *         there's nothing to wait for
+ */
+static inline int
+cli_print_poll(struct cli_session *s)
+{
+	struct cli_print *p = &s->print;
+	uint64_t now = cli_now_ns();
+	int pending;
+
+	pthread_mutex_lock(&p->lock);
+	cli_print_unwake(p);
+	pending = p->len > 0;
+	pthread_mutex_unlock(&p->lock);
+
+	if (!pending) {
+		return -1;
+	} else if (now - p->last_ns < p->interval_ns) {
+		return (int)((p->interval_ns - (now - p->last_ns)) / 1000000) + 1;
+	}
+
+	cli_print_show(s);
+	cli_session_flush(s);
+	return -1;
+}
+
+/* save the finished line in the history file */
+static inline void
+cli_history_append(struct cli_session *s)
+{
+	struct cli_line *line = &s->line;
+	size_t len = cli_line_len(line);
+
+	if (!s->hist.persist || len == 0 || cli_line_reserve(line, 1) != 0) {
+		return;
+	}
+
+	/* the gap is at the end of the line, put the newline there
+	 * to write everything at once */
+	line->buf[len] = '\n';
+	if (write(s->hist.fd, line->buf, len + 1) < 0) {
+		/* it's still in the memory */
+	}
+}
+
+/* draw the finished line, leave the cursor on the next one */
+static inline void
+cli_finish(struct cli_session *s, int status)
+{
+	struct cli_line *line = &s->line;
+
+	s->esc.state = CLI_ESC_NONE;
+	s->pasting = 0;
+	s->paste_match = 0;
+	s->search.active = 0;
+	s->sugg_len = 0;
+	if (!s->plain) {
+		cli_session_redraw(s, cli_line_len(line));
+		cli_out_str(&s->out, "\r\n");
+	}
+	CLI_STAT_ADD(s, bytes_dropped, s->dropped);
+
+	if (status == CLI_LINE_READY) {
+		s->state = CLI_STATE_READY;
+		/* close the gap, so the line is contiguous */
+		cli_line_move(line, cli_line_len(line));
+		if (CLI_GETS_HISTORY && !s->history_cb && !s->plain) {
+			cli_history_add(&s->hist, line->buf, cli_line_len(line));
+			cli_history_append(s);
+		}
+	} else {
+		s->state = CLI_STATE_IDLE;
+	}
+}
+
+/**
+ * Take input that isn't coming from a terminal, e.g. from a pipe or a file,
+ * as it is. There's nothing to edit or echo, so it's just split into lines
+ * ending with \n (or \r\n).
+ */
+static inline int
+cli_process_plain(struct cli_session *s, const unsigned char *data, size_t n, size_t *used)
+{
+	struct cli_line *line = &s->line;
+	const unsigned char *nl = (const unsigned char *)memchr(data, '\n', n);
+	size_t run = nl ? (size_t)(nl - data) : n, done;
+
+	/* the cursor is always at the end */
+	done = cli_line_insert_n(line, (const char *)data, run);
+	s->dropped += run - done;
+	*used = nl ? run + 1 : n;
+	CLI_STAT_ADD(s, bytes_read, *used);
+	if (nl == NULL) {
+		return CLI_NEED_MORE;
+	}
+
+	if (line->gap > 0 && line->buf[line->gap - 1] == '\r') {
+		line->gap--;
+	}
+	cli_finish(s, CLI_LINE_READY);
+	return CLI_LINE_READY;
+}
+
+/**
+ * Run input through the editor and redraw the line once afterwards.
+ *
+ * \param used number of processed bytes. Anything after the end of the line
+ *        is left unprocessed.
+ */
+static inline int
+cli_process(struct cli_session *s, const unsigned char *data, size_t n, size_t *used)
+{
+	const struct cli_keymap *keys = cli_keymap(s);
+	struct cli_line *line = &s->line;
+	const unsigned char *cr;
+	int rc = CLI_NEED_MORE;
+	size_t i, run, pos, done;
+	CLI_STAT_TIMER(s, start);
+
+	if (s->plain) {
+		return cli_process_plain(s, data, n, used);
+	}
+
+	if (s->esc.state != CLI_ESC_NONE &&
+	    cli_now_ns() - s->esc.start_ns > CLI_ESC_TIMEOUT_MS * 1000000ULL) {
+		/* nothing followed the escape key for a while, so it was just
+		 * that and not the beginning of a sequence */
+		s->esc.state = CLI_ESC_NONE;
+	}
+
+	i = 0;
+	while (i < n && rc == CLI_NEED_MORE) {
+		if (s->pasting) {
+			i += cli_paste(s, data + i, n - i);
+		} else if (s->state == CLI_STATE_DRAINING) {
+			/* the following input won't be saved, but let's
+			 * not stop getting user input. Skip straight to
+			 * the end of the line */
+			cr = (const unsigned char *)memchr(data + i, 0xD, n - i);
+			run = cr ? (size_t)(cr - data) - i : n - i;
+			s->dropped += run;
+			i += run;
+			if (cr) {
+				i++;
+				rc = CLI_LINE_READY;
+			}
+			continue;
+		} else if (s->esc.state == CLI_ESC_NONE && !s->search.active && !keys->bind_text &&
+			   (run = cli_scan_ctrl(data + i, n - i)) > 0) {
+			/* plain text, e.g. pasted without the bracketed paste */
+			pos = line->gap;
+			done = cli_insert_text(s, (const char *)data + i, run);
+			cli_undo_record_typed(s, pos, line->buf + pos, done);
+			i += run;
+		} else {
+			rc = cli_key(s, data[i++]);
+		}
+
+		if (rc == CLI_NEED_MORE && !s->pasting && cli_line_full(line)) {
+			s->state = CLI_STATE_DRAINING;
+		}
+	}
+
+	*used = i;
+	if (rc == CLI_NEED_MORE) {
+		cli_suggest(s);
+		cli_session_redraw(s, line->gap);
+	} else {
+		cli_finish(s, rc);
+	}
+	CLI_STAT_ADD(s, bytes_read, i);
+	CLI_STAT_ELAPSED(s, loop_ns, start);
+	cli_session_flush(s);
+	return rc;
+}
+
+/* process input that was queued earlier */
+static inline int
+cli_process_queued(struct cli_session *s)
+{
+	struct cli_input *in = &s->in;
+	size_t used;
+	int rc;
+
+	if (in->pos == in->len) {
+		return CLI_NEED_MORE;
+	}
+
+	rc = cli_process(s, in->buf + in->pos, in->len - in->pos, &used);
+	in->pos += used;
+	return rc;
+}
+
+/* start reading a new line of up to max characters */
+static inline void
+cli_begin(struct cli_session *s, size_t max)
+{
+	if (cli_print_active(&s->print)) {
+		/* anything printed in between goes above the prompt */
+		cli_print_show(s);
+	}
+
+	cli_line_reset(&s->line, max);
+	s->state = max > 0 ? CLI_STATE_EDITING : CLI_STATE_DRAINING;
+	s->dropped = 0;
+	s->esc.state = CLI_ESC_NONE;
+	s->pasting = 0;
+	s->paste_match = 0;
+	s->hist.pos = s->hist.count;
+	s->search.active = 0;
+	cli_undo_reset(&s->undo);
+	s->comp.pending = 0;
+	s->comp.n = 0;
+
+	if (!s->plain) {
+		cli_draw_prompt(s);
+	}
+}
+
+/**
+ * Show a message above the line being edited, e.g. a log line. This can
+ * be called from any thread. The messages are queued, and the editor shows
+ * them all at once, no more than at the rate set with
+ * cli_session_set_print_rate(). They're also shown right before the prompt
+ * of the next line.
+ *
+ * The editor needs to be waiting for input from cli_session_gets(),
+ * cli_session_readline(), or an event loop that polls cli_session_print_fd()
+ * as well. Until the first message, the editor doesn't watch for them at
+ * all, so that one may only be shown after the next key, unless
+ * cli_session_print_fd() was called before.
+ *
+ * \param s session
+ * \param text message, a newline is added after it if it doesn't end with one
+ * \param len length of text
+ * \return 0 on success, -1 if too many messages are already waiting
+ */
+static inline int
+cli_session_print(struct cli_session *s, const char *text, size_t len)
+{
+	struct cli_print *p = &s->print;
+	size_t size, need;
+	int nl = len == 0 || text[len - 1] != '\n';
+	char *buf;
+	int rc = 0;
+
+	if (!p->enabled) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	need = p->len + len + nl;
+	if (need > CLI_PRINT_MAX || cli_print_start(p) != 0) {
+		rc = -1;
+	} else if (need > p->size) {
+		size = p->size ? p->size : 1024;
+		while (size < need) {
+			size *= 2;
+		}
+		buf = (char *)realloc(p->buf, size);
+		if (buf == NULL) {
+			rc = -1;
+		} else {
+			p->buf = buf;
+			p->size = size;
+		}
+	}
+
+	if (rc == 0) {
+		memcpy(p->buf + p->len, text, len);
+		p->len += len;
+		if (nl) {
+			p->buf[p->len++] = '\n';
+		}
+		if (!p->woken && write(p->wake[1], "", 1) == 1) {
+			p->woken = 1;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+/**
+ * Limit how often the messages from cli_session_print() are shown, which
+ * costs redrawing the line each time. Any messages that arrive in between
+ * are shown together.
+ *
+ * \param s session
+ * \param rate max times per second, CLI_PRINT_RATE by default
+ */
+static inline void
+cli_session_set_print_rate(struct cli_session *s, unsigned rate)
+{
+	s->print.interval_ns = rate > 0 ? 1000000000ULL / rate : 0;
+}
+
+/**
+ * Get the file descriptor that becomes readable when there are messages
+ * from cli_session_print() to show. In an event loop using cli_feed(),
+ * call cli_session_print_flush() whenever it's readable.
+ *
+ * \return the descriptor, or -1 if printing isn't available
+ */
+static inline int
+cli_session_print_fd(struct cli_session *s)
+{
+	struct cli_print *p = &s->print;
+	int rc;
+
+	if (!p->enabled) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	rc = cli_print_start(p);
+	pthread_mutex_unlock(&p->lock);
+	return rc == 0 ? p->wake[0] : -1;
+}
+
+/**
+ * Show the messages from cli_session_print() that are waiting, unless they
+ * were shown too recently.
+ *
+ * \return number of milliseconds after which this should be called again,
+ *         or -1 if nothing is waiting anymore
+ */
+static inline int
+cli_session_print_flush(struct cli_session *s)
+{
+	if (!cli_print_active(&s->print)) {
+		return -1;
+	}
+
+	return cli_print_poll(s);
+}
+
+/**
+ * Print the prompt and start reading a new line. Any input that was
+ * queued after the previous line is processed right away.
+ *
+ * This is only needed with cli_feed(), which begins the line on its own
+ * if one isn't in progress yet.
+ *
+ * \return CLI_LINE_READY, CLI_NEED_MORE or CLI_EOF, see cli_feed()
+ */
+static inline int
+cli_session_begin(struct cli_session *s)
+{
+	int rc;
+
+	if (s->state == CLI_STATE_EDITING || s->state == CLI_STATE_DRAINING) {
+		return CLI_NEED_MORE;
+	} else if (s->state == CLI_STATE_READY) {
+		return CLI_LINE_READY;
+	}
+
+	cli_begin(s, s->line_max);
+	rc = cli_process_queued(s);
+	cli_session_flush(s);
+	return rc;
+}
+
+/**
+ * Push input to the editor without ever blocking. This is meant for event
+ * loops, which should wait for cli_session_fd() to become readable, read()
+ * whatever is available, and pass it here.
+ *
+ * Once the line is complete, it can be retrieved with cli_session_getline().
+ * Any input following it is queued and processed after the next line begins.
+ *
+ * \param s session
+ * \param bytes input from the terminal
+ * \param n number of bytes, 0 to signal EOF
+ * \return CLI_LINE_READY if the line is complete, CLI_NEED_MORE if it's not,
+ *         or CLI_EOF on the end of input with an empty line (e.g. ctrl-d),
+ *         or once a telnet client left more than CLI_OUTPUT_BACKLOG_MAX
+ *         bytes unread
+ */
+static inline int
+cli_feed(struct cli_session *s, const char *bytes, size_t n)
+{
+	size_t used, len;
+	int rc;
+
+	if (s->out.lost) {
+		return CLI_EOF;
+	}
+
+	if (s->telnet.enabled && n > 0) {
+		/* filter it in the queue, and process it from there */
+		if (cli_input_push(&s->in, bytes, n) != 0) {
+			return CLI_EOF;
+		}
+		len = s->in.len - n;
+		s->in.len = len + cli_telnet_filter(&s->telnet, s->in.buf + len, n);
+
+		rc = cli_session_begin(s);
+		return rc == CLI_NEED_MORE ? cli_process_queued(s) : rc;
+	}
+
+	rc = cli_session_begin(s);
+	if (rc != CLI_NEED_MORE) {
+		if (rc == CLI_LINE_READY && cli_input_push(&s->in, bytes, n) != 0) {
+			return CLI_EOF;
+		}
+		return rc;
+	}
+
+	if (n == 0) {
+		/* EOF ends the line, if there is one */
+		rc = cli_line_len(&s->line) > 0 ? CLI_LINE_READY : CLI_EOF;
+		cli_finish(s, rc);
+		cli_session_flush(s);
+		return rc;
+	}
+
+	rc = cli_process(s, (const unsigned char *)bytes, n, &used);
+	if (cli_input_push(&s->in, bytes + used, n - used) != 0) {
+		return CLI_EOF;
+	}
+	return rc;
+}
+
+/**
+ * Get the line after cli_feed() returned CLI_LINE_READY. The next line
+ * begins with the next cli_feed() or cli_session_begin() call.
+ *
+ * \param s session
+ * \param buf Buffer where the line will be put. It will always be
+ *        null-terminated.
+ * \param blen Max size of buf (including the null terminator).
+ * \return length of the line, or -1 if there's no complete line
+ */
+static inline int
+cli_session_getline(struct cli_session *s, char *buf, size_t blen)
+{
+	struct cli_line *line = &s->line;
+	size_t len = cli_line_len(line);
+
+	if (s->state != CLI_STATE_READY) {
+		return -1;
+	}
+
+	/* the gap was moved to the end of the line in cli_finish() */
+	if (len > blen - 1) {
+		len = blen - 1;
+	}
+	if (len > 0) {
+		memcpy(buf, line->buf, len);
+	}
+	buf[len] = 0;
+
+	s->state = CLI_STATE_IDLE;
+	return len;
+}
+
+/**
+ * Get the line after cli_feed() returned CLI_LINE_READY, like
+ * cli_session_getline(), but without copying it. The next line begins
+ * with the next cli_feed() or cli_session_begin() call.
+ *
+ * \param s session
+ * \param len set to the length of the line
+ * \return the null-terminated line in the session's own memory, valid until
+ *         the next line begins, or NULL if there's no complete line
+ */
+static inline const char *
+cli_session_line(struct cli_session *s, size_t *len)
+{
+	struct cli_line *line = &s->line;
+
+	if (s->state != CLI_STATE_READY) {
+		return NULL;
+	}
+
+	/* the gap was moved to the end of the line in cli_finish(),
+	 * and the terminator goes into it */
+	s->state = CLI_STATE_IDLE;
+	if (cli_line_reserve(line, 1) != 0) {
+		return NULL;
+	}
+	*len = cli_line_len(line);
+	line->buf[*len] = 0;
+	return line->buf;
+}
+
+/**
+ * Get the number of input bytes that were discarded from the last line
+ * because it was longer than the max length. Anything typed or pasted
+ * after the line was full, up until the carriage return, is dropped.
+ */
+static inline size_t
+cli_session_dropped(const struct cli_session *s)
+{
+	return s->dropped;
+}
+
+/**
+ * Check if the last cli_session_gets() or cli_session_readline() call
+ * returned because of cli_session_set_timeout(), rather than EOF.
+ */
+static inline int
+cli_session_timed_out(const struct cli_session *s)
+{
+	return s->timed_out;
+}
+
+/**
+ * Get the input file descriptor to wait on before calling cli_feed().
+ */
+static inline int
+cli_session_fd(struct cli_session *s)
+{
+	return s->fd;
+}
+
+/**
+ * Send the output a telnet client didn't take right away. Event loops
+ * using cli_feed() should wait for cli_session_fd() to become writable
+ * as long as this returns non-zero, and call it again then. It's best not
+ * to feed the session any more input in the meantime.
+ *
+ * \return number of bytes still waiting to be sent
+ */
+static inline size_t
+cli_session_send(struct cli_session *s)
+{
+	cli_session_flush(s);
+	return s->out.len;
+}
+
+/* the blocking reads do wait for a telnet client to take the output */
+static inline void
+cli_session_drain(struct cli_session *s)
+{
+	struct pollfd pfd = { s->out.fd, POLLOUT, 0 };
+
+	while (cli_session_send(s) > 0) {
+		poll(&pfd, 1, -1);
+	}
+}
+
+/**
+ * Get the time left until cli_session_set_timeout() ends the wait.
+ *
+ * \param start when the wait began
+ * \param last when the last input came
+ * \return milliseconds left, rounded up, or -1 if there's no timeout
+ */
+static inline int
+cli_timeout_left(const struct cli_session *s, uint64_t start, uint64_t last)
+{
+	uint64_t now = cli_now_ns(), end = UINT64_MAX, left;
+
+	if (s->deadline_ms > 0) {
+		end = start + s->deadline_ms * 1000000ULL;
+	}
+	if (s->idle_ms > 0 && last + s->idle_ms * 1000000ULL < end) {
+		end = last + s->idle_ms * 1000000ULL;
+	}
+
+	if (end == UINT64_MAX) {
+		return -1;
+	} else if (now >= end) {
+		return 0;
+	}
+	left = (end - now + 999999) / 1000000;
+	return left < INT_MAX ? (int)left : INT_MAX;
+}
+
+/* read until the end of the line, blocking; see cli_feed() for return values */
+static inline int
+cli_wait(struct cli_session *s, size_t max)
+{
+	struct cli_input *in = &s->in;
+	uint64_t start = 0, last = 0;
+	int rc = CLI_NEED_MORE, left, printing;
+
+	if (s->deadline_ms > 0 || s->idle_ms > 0) {
+		start = last = cli_now_ns();
+	}
+	s->timed_out = 0;
+
+	if (s->state == CLI_STATE_IDLE) {
+		/* in case a timeout restored the terminal */
+		cli_tty_raw(s);
+		cli_begin(s, max);
+		rc = cli_process_queued(s);
+		cli_session_flush(s);
+	} else if (s->state == CLI_STATE_READY) {
+		rc = CLI_LINE_READY;
+	}
+
+	while (rc == CLI_NEED_MORE) {
+		int fresh = in->pos == in->len;
+
+		cli_session_drain(s);
+		if (s->out.lost) {
+			rc = CLI_EOF;
+			break;
+		}
+
+		printing = cli_print_active(&s->print);
+		if ((printing || start > 0) && fresh) {
+			struct pollfd pfd[2] = { { s->fd, POLLIN, 0 },
+						 { printing ? s->print.wake[0] : -1, POLLIN, 0 } };
+			int timeout = printing ? cli_print_poll(s) : -1;
+
+			left = start > 0 ? cli_timeout_left(s, start, last) : -1;
+			if (left == 0) {
+				/* drop the line, and don't leave the terminal raw */
+				cli_finish(s, CLI_TIMEOUT);
+				cli_tty_restore(s);
+				cli_session_flush(s);
+				s->timed_out = 1;
+				rc = CLI_TIMEOUT;
+				break;
+			} else if (left > 0 && (timeout < 0 || left < timeout)) {
+				timeout = left;
+			}
+
+			if (poll(pfd, 2, timeout) <= 0 || pfd[0].revents == 0) {
+				/* just the messages, the time to show them, or the timeout */
+				continue;
+			}
+			last = cli_now_ns();
+		}
+
+		CLI_STAT_ADD(s, reads, fresh);
+		if (cli_input_fill(in, s->fd) != 0) {
+			/* treat EOF like the end of the line */
+			rc = cli_feed(s, NULL, 0);
+			break;
+		}
+		if (s->telnet.enabled && fresh) {
+			in->len = cli_telnet_filter(&s->telnet, in->buf, in->len);
+		}
+		rc = cli_process_queued(s);
+	}
+
+	cli_session_drain(s);
+	return rc;
+}
+
+/**
+ * gets() with arrow-navigation, backspace, history, home/end buttons support, etc.
+ *
+ * \param s session opened with cli_session_open()
+ * \param buf Buffer where the user input will be put. It will always be
+ *        null-terminated.
+ * \param blen Max size of buf (including the null terminator).
+ * \return number of input bytes that didn't fit in buf and were discarded
+ *         (0 if the whole line fit, at most INT_MAX), -1 on EOF with
+ *         no input, or CLI_TIMEOUT
+ */
+static inline int
+cli_session_gets(struct cli_session *s, char *buf, size_t blen)
+{
+	int rc;
+
+	/* terminate any previous (or junk) data */
+	buf[0] = 0;
+
+	rc = cli_wait(s, blen - 1);
+	if (rc != CLI_LINE_READY) {
+		/* CLI_EOF or CLI_TIMEOUT */
+		return rc;
+	}
+
+	cli_session_getline(s, buf, blen);
+	return s->dropped < INT_MAX ? (int)s->dropped : INT_MAX;
+}
+
+/**
+ * Read a line of any length into memory owned by the session. The buffer
+ * grows as needed and is reused for the following lines, so there are no
+ * allocations once it's big enough. The length can be still limited with
+ * cli_session_set_line_max().
+ *
+ * \param s session opened with cli_session_open()
+ * \param len set to the length of the line
+ * \return the null-terminated line, valid until the next line begins, or
+ *         NULL on EOF with no input, or on a timeout, see
+ *         cli_session_timed_out()
+ */
+static inline const char *
+cli_session_readline(struct cli_session *s, size_t *len)
+{
+	if (cli_wait(s, s->line_max) != CLI_LINE_READY) {
+		return NULL;
+	}
+
+	return cli_session_line(s, len);
+}
+
+/**
+ * Read a single line with cli_session_gets(). The terminal is switched to
+ * the raw mode only for the duration of this call. Prefer a cli_session
+ * when reading many lines in a row.
+ *
+ * The input is read straight from STDIN_FILENO, bypassing stdio. Anything
+ * typed or pasted after the end of the line is saved for the next call.
+ *
+ * \param f_out FILE for printing the user input. Usually stdout or stderr.
+ * \param str Any custom string to print before the command prompt.
+ *        Must be null-terminated.
+ * \param buf Buffer where the user input will be put. It will always be
+ *        null-terminated.
+ * \param blen Max size of buf (including the null terminator).
+ * \param history_cb function to retrieve previous/next user command whenever the
+ *        up or down key is pressed. This callback is optional, can be NULL. Then
+ *        up/down keys simply won't do anything.
+ * \return number of discarded input bytes, or -1 on EOF with no input,
+ *         see cli_session_gets()
+ */
+static inline int
+cli_gets(FILE *f_out, const char *str, char *buf, size_t blen, cli_history_cb history_cb)
+{
+	/* not opened with cli_session_open() to keep any input that
+	 * followed the previous line */
+	static struct cli_session s;
+	static int checked;
+	int rc;
+
+	if (!checked) {
+		/* with the input piped in, skip the terminal handling entirely */
+		s.plain = !isatty(STDIN_FILENO);
+		checked = 1;
+	}
+
+	s.fd = STDIN_FILENO;
+	s.f_out = f_out;
+	s.out.fd = fileno(f_out);
+	s.prompt = str;
+	s.history_cb = history_cb;
+
+	cli_tty_raw(&s);
+	rc = cli_session_gets(&s, buf, blen);
+	cli_tty_restore(&s);
+	return rc;
+}
+
+#ifdef __linux__
+/* max number of sessions handled in one cli_server_run() iteration */
+#define CLI_SERVER_EVENTS 64
+
+/**
+ * Many sessions, e.g. one for each telnet connection, driven from a single
+ * epoll loop in one thread.
+ */
+struct cli_server {
+	int epfd;
+};
+
+/**
+ * Called for each line read by cli_server_run().
+ *
+ * \param s session the line was read from
+ * \param line the null-terminated line, valid until the callback returns,
+ *        or NULL if the client is gone and the session should be closed
+ * \param len length of line
+ * \param arg argument given to cli_server_run()
+ * \return 0 to continue, or non-zero if the session was removed (and
+ *         possibly closed) by the callback
+ */
+typedef int (*cli_server_cb)(struct cli_session *s, const char *line, size_t len, void *arg);
+
+static inline int
+cli_server_open(struct cli_server *srv)
+{
+	srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+	return srv->epfd < 0 ? -1 : 0;
+}
+
+static inline void
+cli_server_close(struct cli_server *srv)
+{
+	close(srv->epfd);
+}
+
+/**
+ * Wait for the session's output to be sent, if there's any left, and
+ * only then for more input, so a client that doesn't read can't make the
+ * server buffer any more for it.
+ */
+static inline int
+cli_server_watch(struct cli_server *srv, struct cli_session *s, int op)
+{
+	struct epoll_event ev;
+	int polling = s->out.len > 0;
+
+	if (op == EPOLL_CTL_MOD && polling == s->out.polling) {
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = polling ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = s;
+	if (epoll_ctl(srv->epfd, op, s->fd, &ev) != 0) {
+		return -1;
+	}
+	s->out.polling = polling;
+	return 0;
+}
+
+/**
+ * Start reading lines from the session, and print its prompt.
+ *
+ * \return 0 on success, -1 on error
+ */
+static inline int
+cli_server_add(struct cli_server *srv, struct cli_session *s)
+{
+	cli_session_begin(s);
+	return cli_server_watch(srv, s, EPOLL_CTL_ADD);
+}
+
+static inline void
+cli_server_remove(struct cli_server *srv, struct cli_session *s)
+{
+	epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+}
+
+/**
+ * Wait for input from any of the sessions, and feed it to them. The
+ * callback is called for each complete line. The output is never waited
+ * for. A client that doesn't read it isn't read from either until it
+ * does.
+ *
+ * \param srv server
+ * \param timeout_ms max time to wait for input, -1 to wait indefinitely
+ * \param cb function handling the lines
+ * \param arg passed to cb
+ * \return number of sessions that got input, 0 on timeout, -1 on error
+ */
+static inline int
+cli_server_run(struct cli_server *srv, int timeout_ms, cli_server_cb cb, void *arg)
+{
+	struct epoll_event ev[CLI_SERVER_EVENTS];
+	char buf[CLI_INPUT_CHUNK];
+	struct cli_session *s;
+	const char *line;
+	ssize_t n;
+	size_t len;
+	int i, count, rc;
+
+	count = epoll_wait(srv->epfd, ev, CLI_SERVER_EVENTS, timeout_ms);
+	if (count < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		s = (struct cli_session *)ev[i].data.ptr;
+		if (s->out.polling) {
+			/* nothing is read until the rest of the output is sent */
+			cli_session_send(s);
+			rc = CLI_NEED_MORE;
+			n = 1;
+		} else {
+			n = read(s->fd, buf, sizeof(buf));
+			if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+				continue;
+			}
+
+			rc = cli_feed(s, buf, n > 0 ? n : 0);
+			while (rc == CLI_LINE_READY) {
+				line = cli_session_line(s, &len);
+				if (line && cb(s, line, len, arg) != 0) {
+					s = NULL;
+					break;
+				}
+				rc = cli_session_begin(s);
+			}
+			if (s == NULL) {
+				continue;
+			}
+		}
+
+		if (rc == CLI_EOF || (rc == CLI_NEED_MORE && n <= 0) || s->out.lost ||
+		    cli_server_watch(srv, s, EPOLL_CTL_MOD) != 0) {
+			cb(s, NULL, 0, arg);
+		}
 	}
 
-	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-	fprintf(f_out, "\xD%s > %s\n", str, buf);
+	return count;
 }
+#endif
 
+#endif /* CLI_GETS_H */
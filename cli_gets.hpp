@@ -0,0 +1,151 @@
+/*-
+ * The MIT License
+ *
+ * Copyright 2019 Darek Stojaczyk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CLI_GETS_HPP
+#define CLI_GETS_HPP
+
+#include <string_view>
+
+#include "cli_gets.h"
+
+namespace cli {
+
+/**
+ * A cli_session owned by a C++ object. The terminal is switched to the raw
+ * mode when it's created and restored when it's destroyed. It can be moved,
+ * but not copied.
+ *
+ * The session itself stays at the same address, as the terminal cleanup
+ * and the print thread refer to it.
+ */
+class session {
+public:
+	/**
+	 * \param out where the prompt and the line are drawn, e.g. stderr
+	 * \param prompt shown before the line, must outlive the session
+	 * \param history_cb see cli_history_cb, or nullptr for the built-in
+	 *        history
+	 */
+	session(FILE *out, const char *prompt, cli_history_cb history_cb = nullptr)
+		: s_(new cli_session)
+	{
+		cli_session_open(s_, out, prompt, history_cb);
+	}
+
+	~session()
+	{
+		close();
+	}
+
+	session(session &&other) noexcept : s_(other.s_)
+	{
+		other.s_ = nullptr;
+	}
+
+	session &
+	operator=(session &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			s_ = other.s_;
+			other.s_ = nullptr;
+		}
+		return *this;
+	}
+
+	session(const session &) = delete;
+	session &operator=(const session &) = delete;
+
+	/**
+	 * Read a line, see cli_session_readline().
+	 *
+	 * \return the line in the session's memory, valid until the next line
+	 *         begins, or a view with data() == nullptr on EOF or a timeout
+	 */
+	std::string_view
+	readline()
+	{
+		size_t len;
+		const char *line = cli_session_readline(s_, &len);
+
+		return line ? std::string_view(line, len) : std::string_view();
+	}
+
+	/**
+	 * Get the line after cli_feed() returned CLI_LINE_READY, see
+	 * cli_session_line().
+	 *
+	 * \return the line, or a view with data() == nullptr if there's none
+	 */
+	std::string_view
+	line()
+	{
+		size_t len;
+		const char *line = cli_session_line(s_, &len);
+
+		return line ? std::string_view(line, len) : std::string_view();
+	}
+
+	/* show a message above the line, see cli_session_print() */
+	int
+	print(std::string_view text)
+	{
+		if (text.empty()) {
+			/* its data() may be nullptr */
+			return 0;
+		}
+		return cli_session_print(s_, text.data(), text.size());
+	}
+
+	/* whether the last readline() ended with a timeout */
+	bool
+	timed_out() const
+	{
+		return cli_session_timed_out(s_);
+	}
+
+	/* for everything else, the C API */
+	cli_session *
+	get() const
+	{
+		return s_;
+	}
+
+private:
+	void
+	close() noexcept
+	{
+		if (s_ != nullptr) {
+			cli_session_close(s_);
+			delete s_;
+			s_ = nullptr;
+		}
+	}
+
+	cli_session *s_;
+};
+
+} /* namespace cli */
+
+#endif /* CLI_GETS_HPP */